@@ -5,33 +5,58 @@ TEMPLATE        = app
 TARGET          = RTcmixShell
 
 HEADERS         = audio.h \
+                  batchrender.h \
+                  blockwriter.h \
+                  buffertuner.h \
+                  clipdetect.h \
                   credits.h \
+                  devicecache.h \
+                  dspload.h \
                   editor.h \
                   finddialog.h \
                   highlighter.h \
                   led.h \
+                  levelmeter.h \
                   mainwindow.h \
+                  meterbridge.h \
                   myapp.h \
                   pa_memorybarrier.h \
                   pa_ringbuffer.h \
                   portaudio.h \
                   preferences.h \
                   record.h \
+                  render.h \
+                  renderahead.h \
                   RTcmix_API.h \
                   rtcmixlogview.h \
+                  rthardening.h \
+                  sampleconvert.h \
                   sndfile.h \
+                  truepeak.h \
                   utils.h
 
 SOURCES         = audio.cpp \
+                  batchrender.cpp \
+                  blockwriter.cpp \
+                  buffertuner.cpp \
+                  clipdetect.cpp \
+                  devicecache.cpp \
+                  dspload.cpp \
                   editor.cpp \
                   finddialog.cpp \
                   highlighter.cpp \
                   mainwindow.cpp \
                   main.cpp \
+                  meterbridge.cpp \
                   pa_ringbuffer.c \
                   preferences.cpp \
                   record.cpp \
+                  render.cpp \
+                  renderahead.cpp \
                   rtcmixlogview.cpp \
+                  rthardening.cpp \
+                  sampleconvert.cpp \
+                  truepeak.cpp \
                   utils.cpp
 
 RESOURCES += RTcmixShell.qrc
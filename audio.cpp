@@ -38,9 +38,11 @@
 **
 ****************************************************************************/
 
+#include <chrono>
 #include <QByteArray>
 #include <QDebug>
 #include <QFile>
+#include <QMutexLocker>
 #include <QTimer>
 #include <QVector>
 #include <qmath.h>
@@ -49,40 +51,94 @@
 #include <math.h>
 
 #include "audio.h"
+#include "devicecache.h"
+#include "dspload.h"
 #include "mainwindow.h"
 #include "record.h"
+#include "renderahead.h"
 #define EMBEDDEDAUDIO
 #include "RTcmix_API.h"
+#include "meterbridge.h"
 #include "preferences.h"
+#include "rthardening.h"
+#include "truepeak.h"
 #include "utils.h"
 
-// FIXME: Might want to realloc this if numchans changes
-const int ringBufferNumSamps = 1024 * 32;
+// FLAC and Vorbis encoders work in large blocks, so the record thread takes
+// longer, less evenly, to get through a drain. Give the callback at least this
+// much room while recording in those formats.
+const double compressedMinRecordBufferSeconds = 4.0;
+
+// The record thread drains the ring buffer at least this often (msec), and more
+// often if the ring would otherwise fill up in less than four drain intervals.
+const int maxRecordDrainInterval = 50;
 
-const int consecutiveFullScaleSamps = 2;
 const int clippingTimerInterval = 50;
+const int meterTimerInterval = 33;     // about the display refresh rate we need
+const int dspLoadTimerInterval = 500;
+const int renderAheadPrefillTimeout = 1000;    // msec
+const double truePeakRingSeconds = 0.25;
+const int truePeakDrainInterval = 20;  // msec
 
 
 Audio::Audio()
     : portAudioInitialized(false)
     , rtcmixInitialized(false)
     , stream(NULL)
-    , recordFile(NULL)
+    , streamOutputLatency(0.0)
+    , streamInputLatency(0.0)
+    , latencyLogged(false)
+    , adapterBlock(NULL)
+    , adapterOffset(0)
+    , ringBufferNumSamps(0)
     , recordBuffer(NULL)
-    , transferBuffer(NULL)
     , recordThreadController(NULL)
-    , nowRecording(false)
+    , recordState(RecordIdle)
+    , recordOverflowCount(0)
+    , recordDroppedFrames(0)
+    , recordHighWater(0)
+    , historyLengthSeconds(0)
+    , historyBuffer(NULL)
+    , historyNumFrames(0)
+    , historyFramesWritten(0)
+    , historyThreadController(NULL)
+    , outputUnderflows(0)
+    , outputOverflows(0)
+    , primingBuffers(0)
+    , xrunEventsLost(0)
+    , streamFrames(0)
+    , scoreStartFrame(-1)
+    , reportedUnderflows(0)
+    , reportedOverflows(0)
+    , memoryLockResult(hardeningUnsupported)
+    , hardenPending(false)
+    , hardeningDone(false)
+    , hardeningLogged(false)
+    , threadPriorityResult(hardeningUnsupported)
+    , threadCPUResult(hardeningUnsupported)
+    , flushDenormalsResult(false)
+    , renderAheadBlocks(0)
+    , renderAheadBuffer(NULL)
+    , renderAheadThreadController(NULL)
+    , renderAheadOffset(0)
+    , renderAheadMisses(0)
+    , dspLoad(NULL)
+    , dspLoadTimer(NULL)
     , detectClipping(true)
+    , clipDetect(NULL)
     , consecutiveSamps(NULL)
     , clippingCounts(NULL)
     , clippingTimer(NULL)
+    , meterBridge(NULL)
+    , meterTimer(NULL)
+    , truePeakBuffer(NULL)
+    , truePeaks(NULL)
+    , truePeakThreadController(NULL)
+    , truePeakMaxReset(false)
 {
     // This syncs with the MainWindow-owned settings, even though it's a different object.
     audioPreferences = new Preferences();
 
-    audioApiID = audioPreferences->audioApiID();
-    inputDeviceID = audioPreferences->audioInputDeviceID();
-    outputDeviceID = audioPreferences->audioOutputDeviceID();
     samplingRate = audioPreferences->audioSamplingRate();
 #ifdef INDEPENDENT_INCHANS
     numInChannels = audioPreferences->audioNumInputChannels();
@@ -97,6 +153,7 @@ Audio::Audio()
 #endif
     bufferSize = audioPreferences->audioBufferSize();
     busCount = audioPreferences->audioNumBuses();
+    readStreamPreferences();
 
     mainWindow = getMainWindow();
 
@@ -109,72 +166,187 @@ Audio::Audio()
 Audio::~Audio()
 {
     if (portAudioInitialized) {
-        PaError err = Pa_CloseStream(stream);
-        if (err != paNoError) {
-            const QString msg = QString(tr("Error closing audio device\n(Pa_CloseStream: %1)")).arg(Pa_GetErrorText(err));
-            warnAlert(nullptr, msg);
-        }
-        err = Pa_Terminate();
+        closeStream();
+        portAudioMutex.lock();
+        PaError err = Pa_Terminate();
+        portAudioMutex.unlock();
         if (err != paNoError) {
             const QString msg = QString(tr("Error closing audio device\n(Pa_Terminate: %1)")).arg(Pa_GetErrorText(err));
             warnAlert(nullptr, msg);
         }
     }
+    delete renderAheadThreadController;    // stops calling RTcmix
     if (rtcmixInitialized)
         RTcmix_destroy();
+    free(renderAheadBuffer);
+    free(adapterBlock);
     if (recordBuffer)
         free(recordBuffer);
-    if (transferBuffer)
-        free(transferBuffer);
     delete consecutiveSamps;
     delete clippingCounts;
     delete recordThreadController;
+    delete historyThreadController;    // joins the thread, which may be copying the history
+    free(historyBuffer);
     delete clippingTimer;
+    delete meterTimer;
+    delete meterBridge;
+    delete dspLoadTimer;
+    if (rtHardening && memoryLockResult == 0)
+        unlockProcessMemory();
+    delete dspLoad;
+    delete truePeakThreadController;   // joins the thread before its ring goes away
+    free(truePeakBuffer);
+    delete [] truePeaks;
+}
+
+// Everything but the four settings RTcmix is configured with (sampling rate,
+// channels, buffer size and buses), which are read in the constructor.
+void Audio::readStreamPreferences()
+{
+    audioApiID = audioPreferences->audioApiID();
+    inputDeviceID = audioPreferences->audioInputDeviceID();
+    outputDeviceID = audioPreferences->audioOutputDeviceID();
+    latencyProfile = audioPreferences->audioLatencyProfile();
+    deviceBufferSize = audioPreferences->audioDeviceBufferSize();
+    if (deviceBufferSize < 0 || numInChannels > 0)     // the adapter doesn't buffer input (yet)
+        deviceBufferSize = bufferSize;
+    recordBufferSeconds = audioPreferences->audioRecordBufferSeconds();
+    recordBitDepth = audioPreferences->audioRecordBitDepth();
+    recordSegmentMinutes = audioPreferences->audioRecordSegmentMinutes();
+    recordSegmentMegabytes = audioPreferences->audioRecordSegmentMegabytes();
+    recordSplitChannels = audioPreferences->audioRecordSplitChannels();
+    rtHardening = audioPreferences->audioRealtimeHardening();
+    rtPriority = audioPreferences->audioRealtimePriority();
+    rtCPU = audioPreferences->audioRealtimeCPU();
+    historyLengthSeconds = qBound(0, audioPreferences->audioHistorySeconds(), maxHistorySeconds);
+    renderAheadBlocks = qBound(0, audioPreferences->audioRenderAheadBlocks(), maxRenderAheadBlocks);
+    if (numInChannels > 0)
+        renderAheadBlocks = 0;      // input would be late by the render-ahead latency
 }
 
 int Audio::initializeAudio()
 {
     // Initialize
+    portAudioMutex.lock();
     PaError err = Pa_Initialize();
+    portAudioMutex.unlock();
     if (err != paNoError) {
         const QString msg = QString(tr("Error initializing audio system\n(Pa_Initialize: %1)")).arg(Pa_GetErrorText(err));
         warnAlert(nullptr, msg);
         return -1;
     }
     portAudioInitialized = true;
+    if (validateDeviceCache())
+        qDebug("Audio device list changed; device cache cleared");
+
+    allocateStreamBuffers();
+    err = openStream();
+    if (err != paNoError)
+        return -1;
+
+    clipDetect = clipDetectFunctionForChannels(numOutChannels);
+    consecutiveSamps = new int [numOutChannels];
+    clippingCounts = new std::atomic<int> [numOutChannels];
+    for (int i = 0; i < numOutChannels; i++)
+        consecutiveSamps[i] = clippingCounts[i] = 0;
+
+    clippingTimer = new QTimer(this);
+    CHECKED_CONNECT(clippingTimer, &QTimer::timeout, this, &Audio::checkClipping);
+    CHECKED_CONNECT(this, &Audio::didClip, mainWindow, &MainWindow::showClipping);
+
+    meterBridge = new MeterBridge(numOutChannels, samplingRate);
+    meterPeak.resize(numOutChannels);
+    meterRMS.resize(numOutChannels);
+    meterPeakHold.resize(numOutChannels);
+    meterTimer = new QTimer(this);
+    CHECKED_CONNECT(meterTimer, &QTimer::timeout, this, &Audio::checkMeters);
+    CHECKED_CONNECT(this, &Audio::meterLevels, mainWindow, &MainWindow::showMeterLevels);
+
+    dspLoad = new DspLoadMeter;
+    dspLoadTimer = new QTimer(this);
+    CHECKED_CONNECT(dspLoadTimer, &QTimer::timeout, this, &Audio::checkDspLoad);
+    CHECKED_CONNECT(this, &Audio::dspLoadChanged, mainWindow, &MainWindow::showDspLoad);
+
+    PaUtil_InitializeRingBuffer(&xrunRingBuffer, sizeof(XrunEvent), xrunRingSize, xrunEvents);
+    CHECKED_CONNECT(dspLoadTimer, &QTimer::timeout, this, &Audio::checkXruns);
+    CHECKED_CONNECT(this, &Audio::xrunCountsChanged, mainWindow, &MainWindow::showXrunCounts);
+    CHECKED_CONNECT(this, &Audio::xrunLogged, mainWindow, &MainWindow::showAudioMessage);
+
+    if (rtHardening)
+        memoryLockResult = lockProcessMemory();
+    CHECKED_CONNECT(dspLoadTimer, &QTimer::timeout, this, &Audio::checkHardening);
+    CHECKED_CONNECT(dspLoadTimer, &QTimer::timeout, this, &Audio::checkLatency);
+    CHECKED_CONNECT(this, &Audio::audioMessage, mainWindow, &MainWindow::showAudioMessage);
+
+    // The true-peak ring's elements are whole frames, so the detector never
+    // sees a frame split across the wrap.
+    const quint32 truePeakFrames = quint32(qMax(truePeakRingSeconds * samplingRate, 4.0 * bufferSize));
+    truePeakBuffer = (float *) calloc(qNextPowerOfTwo(truePeakFrames - 1), numOutChannels * sizeof(float));
+    truePeaks = new std::atomic<float> [numOutChannels];
+    for (int c = 0; c < numOutChannels; c++)
+        truePeaks[c] = 0.0f;
+    truePeakMax.fill(0.0f, numOutChannels);
+    if (truePeakBuffer != NULL) {
+        PaUtil_InitializeRingBuffer(&truePeakRingBuffer, numOutChannels * sizeof(float),
+                                    qNextPowerOfTwo(truePeakFrames - 1), truePeakBuffer);
+        truePeakThreadController = new TruePeakThreadController(numOutChannels, &truePeakRingBuffer, truePeaks, truePeakDrainInterval);
+        truePeakThreadController->start();
+    }
+    else {
+        const QString msg = QString(tr("Not enough memory for true peak metering; it is off"));
+        warnAlert(nullptr, msg);
+    }
+    CHECKED_CONNECT(this, &Audio::truePeakLevels, mainWindow, &MainWindow::showTruePeakLevels);
 
+    allocateRecordRing(recordBufferSeconds);
+
+    allocateHistory();
+    CHECKED_CONNECT(this, &Audio::historySaved, mainWindow, &MainWindow::showHistorySaved);
+
+    qDebug("Audio initialized (srate=%d, inchans=%d, outchans=%d, bufsize=%d, device bufsize=%d)",
+           int(samplingRate), numInChannels, numOutChannels, bufferSize, deviceBufferSize);
+    return 0;
+}
+
+// Open the stream on the current device, with the current latency profile
+// and device buffer size. RTcmix doesn't need to know about any of this.
+PaError Audio::openStream()
+{
+    QMutexLocker locker(&portAudioMutex);
 #ifdef USE_INPUT_CHANNELS
     PaStreamParameters inputParameters;
     memset(&inputParameters, 0, sizeof(inputParameters));
     inputParameters.channelCount = numInChannels;
     inputParameters.device = inputDeviceID;
     inputParameters.sampleFormat = paFloat32;
+    inputParameters.suggestedLatency = suggestedLatency(inputDeviceID, false, latencyProfile);
 #endif
     PaStreamParameters outputParameters;
     memset(&outputParameters, 0, sizeof(outputParameters));
     outputParameters.channelCount = numOutChannels;
     outputParameters.device = outputDeviceID;
     outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = suggestedLatency(outputDeviceID, true, latencyProfile);
 #ifdef USE_INPUT_CHANNELS
-    err = Pa_IsFormatSupported(&inputParameters, &outputParameters, samplingRate);
+    PaError err = Pa_IsFormatSupported(&inputParameters, &outputParameters, samplingRate);
     if (err == paFormatIsSupported) {
         err = Pa_OpenStream(&stream,
                             &inputParameters,
                             &outputParameters,
                             samplingRate,
-                            bufferSize,
+                            deviceBufferSize,  // 0 is paFramesPerBufferUnspecified
                             paClipOff | paDitherOff,  // clipping happens inside RTcmix
                             &paCallback,
                             this);
     }
 #else
-    err = Pa_IsFormatSupported(NULL, &outputParameters, samplingRate);
+    PaError err = Pa_IsFormatSupported(NULL, &outputParameters, samplingRate);
     if (err == paFormatIsSupported) {
         err = Pa_OpenStream(&stream,
                             NULL,
                             &outputParameters,
                             samplingRate,
-                            bufferSize,
+                            deviceBufferSize,  // 0 is paFramesPerBufferUnspecified
                             paClipOff | paDitherOff,  // clipping happens inside RTcmix
                             &paCallback,
                             this);
@@ -186,40 +358,196 @@ int Audio::initializeAudio()
                                    numOutChannels,
                                    paFloat32,
                                    samplingRate,
-                                   bufferSize,
+                                   deviceBufferSize,
                                    &paCallback,
                                    this);
     }
     if (err != paNoError) {
+        locker.unlock();
         const QString msg = QString(tr("Error opening audio device\n(Pa_OpenStream: %1)")).arg(Pa_GetErrorText(err));
         warnAlert(nullptr, msg);
-        return -1;
+        stream = NULL;
+        return err;
     }
 
-    consecutiveSamps = new int [numOutChannels];
-    clippingCounts = new std::atomic<int> [numOutChannels];
-    for (int i = 0; i < numOutChannels; i++)
-        consecutiveSamps[i] = clippingCounts[i] = 0;
+    // What we asked for is only a hint; this is what the host API gave us.
+    const PaStreamInfo *streamInfo = Pa_GetStreamInfo(stream);
+    if (streamInfo) {
+        streamOutputLatency = streamInfo->outputLatency;
+        streamInputLatency = streamInfo->inputLatency;
+    }
+    return paNoError;
+}
 
-    clippingTimer = new QTimer(this);
-    CHECKED_CONNECT(clippingTimer, &QTimer::timeout, this, &Audio::checkClipping);
-    CHECKED_CONNECT(this, &Audio::didClip, mainWindow, &MainWindow::showClipping);
+void Audio::closeStream()
+{
+    if (stream == NULL)
+        return;
+    portAudioMutex.lock();
+    PaError err = Pa_CloseStream(stream);
+    portAudioMutex.unlock();
+    if (err != paNoError) {
+        const QString msg = QString(tr("Error closing audio device\n(Pa_CloseStream: %1)")).arg(Pa_GetErrorText(err));
+        warnAlert(nullptr, msg);
+    }
+    stream = NULL;
+    streamOutputLatency = streamInputLatency = 0.0;
+}
 
-    recordBuffer = (float *) calloc(ringBufferNumSamps, sizeof(float));
-    PaUtil_InitializeRingBuffer(&recordRingBuffer, sizeof(float), ringBufferNumSamps, recordBuffer);
-    transferBuffer = (float *) calloc(ringBufferNumSamps, sizeof(float));
+// (Re)allocate the buffers whose size depends on the device buffer size and
+// render-ahead setting. Only call this while the stream is closed: if there
+// isn't the memory for the adapter, the stream has to open with callbacks of
+// <bufferSize> frames instead.
+void Audio::allocateStreamBuffers()
+{
+    free(renderAheadBuffer);
+    renderAheadBuffer = NULL;
+    if (renderAheadBlocks > 0) {
+        const int queueBlocks = int(qNextPowerOfTwo(quint32(renderAheadBlocks - 1)));
+        const int blockBytes = bufferSize * numOutChannels * int(sizeof(float));
+        renderAheadBuffer = (float *) calloc(queueBlocks, blockBytes);
+        if (renderAheadBuffer != NULL) {
+            PaUtil_InitializeRingBuffer(&renderAheadQueue, blockBytes, queueBlocks, renderAheadBuffer);
+            qDebug("Render ahead: %d blocks (%.1f ms extra latency)", renderAheadBlocks, 1000.0 * renderAheadBlocks * bufferSize / samplingRate);
+        }
+        else {
+            const QString msg = QString(tr("Not enough memory to render %1 blocks ahead; render ahead is off")).arg(renderAheadBlocks);
+            warnAlert(nullptr, msg);
+            renderAheadBlocks = 0;
+        }
+    }
 
-    qDebug("Audio initialized (srate=%d, inchans=%d, outchans=%d, bufsize=%d)", int(samplingRate), numInChannels, numOutChannels, bufferSize);
-    return 0;
+    free(adapterBlock);
+    adapterBlock = NULL;
+    if (deviceBufferSize != bufferSize && renderAheadBlocks == 0) {    // render-ahead adapts on its own
+        adapterBlock = (float *) calloc(size_t(bufferSize) * numOutChannels, sizeof(float));
+        adapterOffset = bufferSize;
+        if (adapterBlock == NULL) {
+            const QString msg = QString(tr("Not enough memory for the buffer size adapter; using a device buffer size of %1")).arg(bufferSize);
+            warnAlert(nullptr, msg);
+            deviceBufferSize = bufferSize;
+        }
+    }
+}
+
+// A new history starts empty.
+void Audio::allocateHistory()
+{
+    if (historyThreadController)
+        historyThreadController->waitForSnapshot();     // a save may still be copying the old one
+    free(historyBuffer);
+    historyBuffer = NULL;
+    historyFramesWritten = 0;
+    if (historyLengthSeconds > 0) {
+        historyNumFrames = long(historyLengthSeconds * samplingRate);
+        historyBuffer = (float *) calloc(size_t(historyNumFrames) * numOutChannels, sizeof(float));
+        if (historyBuffer == NULL) {
+            const QString msg = QString(tr("Not enough memory for %1 seconds of history; Save Last Seconds is off")).arg(historyLengthSeconds);
+            warnAlert(nullptr, msg);
+        }
+    }
+}
+
+// Apply changed preferences without tearing down RTcmix, if that's possible:
+// a new device, host API, latency profile, device buffer size and the like
+// only need the stream reopened, which takes a few msec, and whatever is
+// playing carries on. Returns false if anything RTcmix was set up with has
+// changed (or the stream couldn't be reopened); the caller must then replace
+// this object.
+bool Audio::reconfigure()
+{
+    if (!portAudioInitialized || !rtcmixInitialized)
+        return false;
+#ifdef INDEPENDENT_INCHANS
+    const int newInChannels = audioPreferences->audioNumInputChannels();
+#else
+    const int newInChannels = numInChannels;
+#endif
+    if (float(audioPreferences->audioSamplingRate()) != samplingRate
+            || newInChannels != numInChannels
+            || audioPreferences->audioNumOutputChannels() != numOutChannels
+            || audioPreferences->audioBufferSize() != bufferSize
+            || audioPreferences->audioNumBuses() != busCount)
+        return false;
+
+    const bool wasRunning = stream != NULL && Pa_IsStreamActive(stream) == 1;
+    if (stopAudio() != 0)
+        return false;
+    closeStream();
+
+    const bool wasHardening = rtHardening;
+    const double oldRecordBufferSeconds = recordBufferSeconds;
+    const int oldHistoryLengthSeconds = historyLengthSeconds;
+    readStreamPreferences();
+
+    if (rtHardening && !wasHardening)
+        memoryLockResult = lockProcessMemory();
+    else if (!rtHardening && wasHardening) {
+        if (memoryLockResult == 0)
+            unlockProcessMemory();
+        memoryLockResult = hardeningUnsupported;
+    }
+    hardenPending = false;
+    hardeningDone = false;
+    hardeningLogged = false;
+    latencyLogged = false;
+
+    // A take in progress keeps its ring; the new size applies to the next one.
+    if (recordBufferSeconds != oldRecordBufferSeconds && recordState == RecordIdle) {
+        delete recordThreadController;
+        recordThreadController = NULL;
+        allocateRecordRing(recordBufferSeconds);
+    }
+    allocateStreamBuffers();
+    if (historyLengthSeconds != oldHistoryLengthSeconds)
+        allocateHistory();
+
+    if (openStream() != paNoError)
+        return false;
+    qDebug("Audio reconfigured (device bufsize=%d, render ahead=%d)", deviceBufferSize, renderAheadBlocks);
+    if (wasRunning)
+        startAudio();
+    return true;
+}
+
+// Only call this while not recording: the callback touches the ring only
+// when recordState is RecordOn. Returns false if there isn't the memory for
+// it, in which case there is no ring, and armRecording() refuses to record.
+bool Audio::allocateRecordRing(double seconds)
+{
+    // The ring must be a power of 2 frames long, and hold at least a couple of
+    // callbacks' worth. Its elements are whole frames, as for the true-peak ring,
+    // so the record thread never gets a frame split across the wrap.
+    seconds = qBound(minRecordBufferSeconds, seconds, maxRecordBufferSeconds);
+    const quint32 minFrames = quint32(qMax(seconds * samplingRate, 4.0 * bufferSize));
+    free(recordBuffer);
+    const quint32 ringFrames = qNextPowerOfTwo(minFrames - 1);
+    recordBuffer = (float *) calloc(ringFrames, numOutChannels * sizeof(float));
+    if (recordBuffer == NULL) {
+        ringBufferNumSamps = 0;
+        const QString msg = QString(tr("Not enough memory for a %1 second record buffer")).arg(seconds);
+        warnAlert(nullptr, msg);
+        return false;
+    }
+    ringBufferNumSamps = int(ringFrames) * numOutChannels;
+    PaUtil_InitializeRingBuffer(&recordRingBuffer, numOutChannels * sizeof(float), ringFrames, recordBuffer);
+    return true;
 }
 
 int Audio::startAudio()
 {
     if (portAudioInitialized && stream != NULL && Pa_IsStreamStopped(stream)) {
+        if (renderAheadBlocks > 0)
+            startRenderAhead();
+        // Set before the stream starts, so the first callback hardens its
+        // thread before it runs RTcmix.
+        hardenPending = rtHardening;
         PaError err = Pa_StartStream(stream);
         if (err != paNoError) {
             const QString msg = QString(tr("Error starting audio\n(Pa_StartStream: %1)")).arg(Pa_GetErrorText(err));
             warnAlert(nullptr, msg);
+            hardenPending = false;
+            stopRenderAhead();
             return -1;
         }
 //        qDebug("Pa_StartStream returned noerr");
@@ -229,6 +557,15 @@ int Audio::startAudio()
         if (!clippingTimer->isActive())
             clippingTimer->start(clippingTimerInterval);
     }
+    if (!meterTimer->isActive()) {
+        truePeakMax.fill(0.0f);
+        truePeakMaxReset = true;    // shown at the first tick
+        meterTimer->start(meterTimerInterval);
+    }
+    if (!dspLoadTimer->isActive()) {
+        dspLoad->reset();
+        dspLoadTimer->start(dspLoadTimerInterval);
+    }
 
     return 0;
 }
@@ -237,6 +574,19 @@ int Audio::stopAudio()
 {
     if (clippingTimer->isActive())
         clippingTimer->stop();
+    if (meterTimer->isActive()) {
+        meterTimer->stop();
+        meterPeak.fill(0.0f);
+        meterRMS.fill(0.0f);
+        meterPeakHold.fill(0.0f);
+        emit meterLevels(meterPeak, meterRMS, meterPeakHold);
+        checkTruePeaks();   // anything measured since the last tick; the max stays up
+    }
+    if (dspLoadTimer->isActive()) {
+        dspLoadTimer->stop();
+        emit dspLoadChanged(-1.0f, -1.0f, -1.0f, -1.0f);
+        checkXruns();
+    }
 
     if (portAudioInitialized && stream != NULL && Pa_IsStreamActive(stream)) {
         PaError err = Pa_StopStream(stream);
@@ -246,9 +596,83 @@ int Audio::stopAudio()
             return -1;
         }
     }
+    stopRenderAhead();
+    adapterOffset = bufferSize;     // drop the rest of the last vector
     return 0;
 }
 
+// Start the render thread and let it fill the queue before the stream starts,
+// so the first callbacks don't find it empty.
+void Audio::startRenderAhead()
+{
+    if (renderAheadThreadController != NULL)
+        return;
+    renderAheadThreadController = new RenderAheadThreadController(&renderAheadQueue, renderAheadBlocks, bufferSize, samplingRate,
+                                                                  dspLoad, rtHardening, rtPriority);
+    renderAheadThreadController->start();
+    if (!renderAheadThreadController->waitPrimed(renderAheadPrefillTimeout))
+        qDebug("Render ahead: queue not full after %d msec; starting anyway", renderAheadPrefillTimeout);
+}
+
+// Only call this while the stream is stopped. Whatever is left in the queue
+// was rendered for the stream we just stopped, so it goes.
+void Audio::stopRenderAhead()
+{
+    if (renderAheadThreadController == NULL)
+        return;
+    delete renderAheadThreadController;
+    renderAheadThreadController = NULL;
+    PaUtil_FlushRingBuffer(&renderAheadQueue);
+    renderAheadOffset = 0;
+}
+
+// Fill a callback of any size from whole RTcmix vectors, carrying what's left
+// of the last one over to the next callback.
+void Audio::runAdapted(float *output, unsigned long frameCount)
+{
+    unsigned long framesDone = 0;
+    while (framesDone < frameCount) {
+        if (adapterOffset == bufferSize) {
+            const std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+            RTcmix_runAudio(NULL, adapterBlock, bufferSize);
+            const std::chrono::duration<double> runTime = std::chrono::steady_clock::now() - runStart;
+            dspLoad->add(runTime.count() * samplingRate / bufferSize);
+            adapterOffset = 0;
+        }
+        const unsigned long frames = qMin(frameCount - framesDone, (unsigned long) (bufferSize - adapterOffset));
+        memcpy(output + framesDone * numOutChannels, adapterBlock + adapterOffset * numOutChannels,
+               frames * numOutChannels * sizeof(float));
+        framesDone += frames;
+        adapterOffset += frames;
+    }
+}
+
+// Copy frames from the oldest blocks in the queue, and tell the render thread
+// each time a block is used up. If the queue has run dry, output silence.
+void Audio::copyRenderedAhead(float *output, unsigned long frameCount)
+{
+    unsigned long framesDone = 0;
+    while (framesDone < frameCount) {
+        void *block, *unused;
+        ring_buffer_size_t count, unusedCount;
+        if (PaUtil_GetRingBufferReadRegions(&renderAheadQueue, 1, &block, &count, &unused, &unusedCount) == 0) {
+            memset(output + framesDone * numOutChannels, 0, (frameCount - framesDone) * numOutChannels * sizeof(float));
+            renderAheadMisses.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        const unsigned long frames = qMin(frameCount - framesDone, (unsigned long) (bufferSize - renderAheadOffset));
+        memcpy(output + framesDone * numOutChannels, (float *) block + renderAheadOffset * numOutChannels,
+               frames * numOutChannels * sizeof(float));
+        framesDone += frames;
+        renderAheadOffset += frames;
+        if (renderAheadOffset == bufferSize) {
+            PaUtil_AdvanceRingBufferReadIndex(&renderAheadQueue, 1);
+            renderAheadOffset = 0;
+            renderAheadThreadController->blockConsumed();
+        }
+    }
+}
+
 void Audio::checkClipping()
 {
     int clipCount = 0;
@@ -260,6 +684,105 @@ void Audio::checkClipping()
         emit didClip(clipCount);
 }
 
+void Audio::checkMeters()
+{
+    if (meterBridge->read(meterPeak.data(), meterRMS.data(), meterPeakHold.data()))
+        emit meterLevels(meterPeak, meterRMS, meterPeakHold);
+    checkTruePeaks();
+}
+
+void Audio::checkDspLoad()
+{
+    const DspLoadMeter::Stats stats = dspLoad->read();
+    if (stats.callbacks > 0)
+        emit dspLoadChanged(stats.min, stats.avg, stats.p99, stats.max);
+}
+
+// Called from the main thread when a score has parsed, so that xrun reports
+// can say where in the score they happened.
+void Audio::markScoreStart()
+{
+    scoreStartFrame = streamFrames.load(std::memory_order_acquire);
+}
+
+void Audio::checkXruns()
+{
+    XrunEvent event;
+    while (PaUtil_ReadRingBuffer(&xrunRingBuffer, &event, 1) == 1) {
+        QString what;
+        if (event.flags & paOutputUnderflow)
+            what = tr("Audio output underflow (dropout)");
+        else if (event.flags & paOutputOverflow)
+            what = tr("Audio output overflow");
+        else
+            what = tr("Audio output priming");
+        QString msg = QString(tr("%1 at stream time %2 sec")).arg(what).arg(event.streamTime, 0, 'f', 3);
+        if (scoreStartFrame >= 0 && event.frame >= scoreStartFrame)
+            msg += QString(tr(", score time %1 sec")).arg((event.frame - scoreStartFrame) / samplingRate, 0, 'f', 3);
+        emit xrunLogged(msg);
+    }
+    const int misses = renderAheadMisses.exchange(0, std::memory_order_relaxed);
+    if (misses)
+        emit xrunLogged(QString(tr("Render-ahead queue ran dry %1 times (silence output)")).arg(misses));
+    const int lost = xrunEventsLost.exchange(0, std::memory_order_relaxed);
+    if (lost)
+        emit xrunLogged(QString(tr("%1 more audio xruns were not logged")).arg(lost));
+
+    const int underflows = outputUnderflows.load(std::memory_order_relaxed);
+    const int overflows = outputOverflows.load(std::memory_order_relaxed);
+    if (underflows != reportedUnderflows || overflows != reportedOverflows) {
+        reportedUnderflows = underflows;
+        reportedOverflows = overflows;
+        emit xrunCountsChanged(underflows, overflows);
+    }
+}
+
+// Log the stream latency, once the log exists -- i.e., at the first tick
+// after audio starts.
+void Audio::checkLatency()
+{
+    if (latencyLogged)
+        return;
+    latencyLogged = true;
+    static const char *profileNames[] = { QT_TR_NOOP("lowest"), QT_TR_NOOP("balanced"), QT_TR_NOOP("safe") };
+    QString msg = QString(tr("Audio latency (%1): output %2 ms"))
+            .arg(tr(profileNames[qBound(0, latencyProfile, 2)]))
+            .arg(streamOutputLatency * 1000.0, 0, 'f', 1);
+    if (numInChannels > 0)
+        msg += QString(tr(", input %1 ms")).arg(streamInputLatency * 1000.0, 0, 'f', 1);
+    emit audioMessage(msg);
+}
+
+// Report the hardening results once the callback has applied them.
+void Audio::checkHardening()
+{
+    if (!rtHardening || hardeningLogged || !hardeningDone.load(std::memory_order_acquire))
+        return;
+    hardeningLogged = true;     // once per Audio, i.e., per device setup
+    QString msg = tr("Real-time hardening:");
+    msg += QString(tr("\n  lock memory: %1")).arg(hardeningResultString(memoryLockResult));
+    msg += QString(tr("\n  SCHED_FIFO priority %1: %2")).arg(rtPriority).arg(hardeningResultString(threadPriorityResult));
+    if (rtCPU >= 0)
+        msg += QString(tr("\n  pin to CPU %1: %2")).arg(rtCPU).arg(hardeningResultString(threadCPUResult));
+    msg += QString(tr("\n  flush denormals to zero: %1")).arg(flushDenormalsResult ? tr("ok") : tr("not supported on this system"));
+    emit audioMessage(msg);
+}
+
+void Audio::checkTruePeaks()
+{
+    bool changed = truePeakMaxReset;
+    truePeakMaxReset = false;
+    for (int c = 0; c < numOutChannels; c++) {
+        const float peak = truePeaks[c].exchange(0.0f, std::memory_order_relaxed);
+        if (peak > truePeakMax[c]) {
+            truePeakMax[c] = peak;
+            changed = true;
+        }
+    }
+    if (changed)
+        emit truePeakLevels(truePeakMax);
+}
+
 int Audio::memberCallback(
             const void *input,
             void *output,
@@ -267,8 +790,6 @@ int Audio::memberCallback(
             const PaStreamCallbackTimeInfo *timeInfo,
             PaStreamCallbackFlags statusFlags)
 {
-    (void) timeInfo;
-
 #ifdef DEBUG_IN_CALLBACK
     callbackCount++;
     if ((callbackCount % 100) == 0)
@@ -278,11 +799,49 @@ int Audio::memberCallback(
         if ((outputUnderflowCount % 20) == 0)
             qDebug("Five OUTPUT UNDERFLOWs");
     }
-#else
-    (void) statusFlags;
 #endif
 
-    int result = RTcmix_runAudio(const_cast<void *>(input), output, frameCount);
+    if (hardenPending.load(std::memory_order_relaxed) && hardenPending.exchange(false)) {
+        // Once per start, on what may be a new thread, before RTcmix runs.
+        threadPriorityResult = setCurrentThreadRealtime(rtPriority);
+        threadCPUResult = (rtCPU >= 0) ? setCurrentThreadCPU(rtCPU) : 0;
+        flushDenormalsResult = setCurrentThreadFlushDenormals();
+        hardeningDone.store(true, std::memory_order_release);
+    }
+
+    const long long bufferStartFrame = streamFrames.load(std::memory_order_relaxed);
+    const PaStreamCallbackFlags xrunFlags = statusFlags & (paOutputUnderflow | paOutputOverflow | paPrimingOutput);
+    if (xrunFlags) {
+        if (xrunFlags & paOutputUnderflow)
+            outputUnderflows.fetch_add(1, std::memory_order_relaxed);
+        if (xrunFlags & paOutputOverflow)
+            outputOverflows.fetch_add(1, std::memory_order_relaxed);
+        if (xrunFlags & paPrimingOutput)
+            primingBuffers.fetch_add(1, std::memory_order_relaxed);
+        const XrunEvent event = { xrunFlags, timeInfo->outputBufferDacTime, bufferStartFrame };
+        if (PaUtil_WriteRingBuffer(&xrunRingBuffer, &event, 1) == 0)
+            xrunEventsLost.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A triggered recording starts at the top of a callback, so it includes the
+    // whole of the first buffer rendered after the score was parsed.
+    int recordNow = recordState.load(std::memory_order_acquire);
+    if (recordNow == RecordTriggered && recordState.compare_exchange_strong(recordNow, RecordOn))
+        recordNow = RecordOn;
+
+    int result = 0;
+    if (renderAheadThreadController != NULL)
+        copyRenderedAhead((float *) output, frameCount);    // the render thread measures DSP load
+    else if (adapterBlock != NULL)
+        runAdapted((float *) output, frameCount);
+    else {
+        // Time the score's share of the buffer period. This is what gets close to
+        // 100% before a dropout; everything else in the callback is small and fixed.
+        const std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+        result = RTcmix_runAudio(const_cast<void *>(input), output, frameCount);
+        const std::chrono::duration<double> runTime = std::chrono::steady_clock::now() - runStart;
+        dspLoad->add(runTime.count() * samplingRate / frameCount);
+    }
     (void) result;
 #ifdef DEBUG_IN_CALLBACK
     float *p = (float *)output;
@@ -302,49 +861,43 @@ int Audio::memberCallback(
 //    qDebug("RTcmix_runAudio called (result=%d, frameCount=%ld, output=%p)", result, frameCount, output);
 #endif
 
-    if (detectClipping) {
-        // This (over-) simple clipping algorithm thinks a consecutive run of full-scale
-        // samples of length >= consecutiveFullScaleSamps indicates clipping, even if
-        // the signal oscillates between -1 and +1. This is per channel.
-        float *sampPtr = (float *) output;
-        for (unsigned long i = 0; i < frameCount; i++) {
-            for (int c = 0; c < numOutChannels; c++) {
-                float samp = fabs(*sampPtr++);
-                if (samp > 0.999)
-                    consecutiveSamps[c]++;
-                else {
-                    if (consecutiveSamps[c] > consecutiveFullScaleSamps)
-                        clippingCounts[c]++;
-                    consecutiveSamps[c] = 0;
-                }
-            }
-        }
+    meterBridge->process((const float *) output, frameCount);
+
+    // Just a copy; the oversampling happens on the true-peak thread. If that
+    // thread is behind, skip this buffer rather than wait.
+    if (truePeakBuffer != NULL && PaUtil_GetRingBufferWriteAvailable(&truePeakRingBuffer) >= ring_buffer_size_t(frameCount))
+        PaUtil_WriteRingBuffer(&truePeakRingBuffer, output, frameCount);
+
+    if (detectClipping)
+        clipDetect((const float *) output, frameCount, numOutChannels, consecutiveSamps, clippingCounts);
+
+    if (historyBuffer) {
+        // Overwrite the oldest frames of the history, wrapping around its end.
+        const long long written = historyFramesWritten.load(std::memory_order_relaxed);
+        const long start = long(written % historyNumFrames);
+        const long frames1 = qMin(long(frameCount), historyNumFrames - start);
+        memcpy(historyBuffer + start * numOutChannels, output, frames1 * numOutChannels * sizeof(float));
+        if (frames1 < long(frameCount))
+            memcpy(historyBuffer, (float *) output + frames1 * numOutChannels, (frameCount - frames1) * numOutChannels * sizeof(float));
+        historyFramesWritten.store(written + frameCount, std::memory_order_release);
     }
 
-    if (nowRecording) {
-        int failCount = 0;
-        float *ptr = (float *) output;
-        int inSampCount = int(frameCount * numOutChannels);
-        while (inSampCount) {
-            int sampsAvail = PaUtil_GetRingBufferWriteAvailable(&recordRingBuffer);
-            int writeCount = qMin(inSampCount, sampsAvail);
-            if (writeCount > 0) {
-                int sampsWritten = PaUtil_WriteRingBuffer(&recordRingBuffer, ptr, writeCount);
-                inSampCount -= sampsWritten;
-//qDebug("audio callback: sampsAvail=%d, sampsWritten=%d", sampsAvail, sampsWritten);
-                ptr += sampsWritten;
-            }
-            else
-                failCount++;
-            if (failCount > 0) {
-//qDebug("audio callback: ring buffer write not available (1 time)");
-                failCount = 0;
-//                break;
-            }
+    if (recordNow == RecordOn) {
+        // Never wait for the record thread: if it has fallen so far behind that
+        // this whole buffer doesn't fit in the ring, drop the buffer and count it.
+        if (PaUtil_GetRingBufferWriteAvailable(&recordRingBuffer) >= ring_buffer_size_t(frameCount)) {
+            PaUtil_WriteRingBuffer(&recordRingBuffer, output, frameCount);
+            const int fill = int(PaUtil_GetRingBufferReadAvailable(&recordRingBuffer)) * numOutChannels;
+            if (fill > recordHighWater.load(std::memory_order_relaxed))
+                recordHighWater.store(fill, std::memory_order_relaxed);
+        }
+        else {
+            recordOverflowCount.fetch_add(1, std::memory_order_relaxed);
+            recordDroppedFrames.fetch_add(frameCount, std::memory_order_relaxed);
         }
-//qDebug("audio callback: loop done (inSampCount=%d)", inSampCount);
     }
 
+    streamFrames.store(bufferStartFrame + frameCount, std::memory_order_release);
     return paContinue;
 }
 
@@ -397,62 +950,154 @@ int Audio::reinitializeRTcmix(bool interactive)
     return 0;
 }
 
-bool Audio::startRecording(const QString &fileName)
+// Stop audio and shut down RTcmix, so that someone else (e.g., the offline
+// renderer) can have it. Call reinitializeRTcmix() to get it back.
+void Audio::releaseRTcmix()
 {
-    QByteArray ba = fileName.toLatin1();
-    char *fname = ba.data();
+    stopAudio();
+    if (rtcmixInitialized) {
+        RTcmix_destroy();
+        rtcmixInitialized = false;
+    }
+}
 
-    SF_INFO sfinfo;
-    memset(&sfinfo, 0, sizeof(sfinfo));
-    sfinfo.samplerate = samplingRate;
-    sfinfo.channels = numOutChannels;
-    if (fileName.endsWith(".wav"))
-        sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;        // TODO: option for SF_FORMAT_PCM_24
-    else if (fileName.endsWith(".aif") || fileName.endsWith(".aiff"))
-        sfinfo.format = SF_FORMAT_AIFF | SF_FORMAT_FLOAT;
-    else {
-        const QString msg = QString(tr("Invalid sound file name extension (must be \".wav\", \".aif\", or \".aiff\""));
+// Get everything ready to record -- open the file, size the ring, start the
+// record thread -- without recording anything until triggerRecording().
+// Doing all this before the score is parsed means nothing is lost at the start.
+bool Audio::armRecording(const QString &fileName)
+{
+    if (recordState != RecordIdle) {
+        const QString msg = QString(tr("Error: starting recording while recording already in progress"));
         warnAlert(nullptr, msg);
         return false;
     }
-    if (!sf_format_check(&sfinfo)) {
-        const QString msg = QString(tr("Invalid sound file format requested (startRecording)"));
-        warnAlert(nullptr, msg);
+    // The ring may not have fit when it was allocated; try again now.
+    if (recordBuffer == NULL && !allocateRecordRing(recordBufferSeconds))
         return false;
-    }
 
-    recordFile = sf_open(fname, SFM_WRITE, &sfinfo);
-    if (recordFile == NULL) {
-        const QString msg = QString(tr("Error opening sound file for recording\n(startRecording: sf_open returned NULL (%2))")).arg(sf_strerror(recordFile));
+    // The record thread takes ownership of this, and closes it when done.
+    RecordFile *recordFile = new RecordFile();
+    recordFile->setSplitChannels(recordSplitChannels);
+    if (!recordFile->open(fileName, int(samplingRate), numOutChannels, recordBitDepth,
+                          recordSegmentMinutes, recordSegmentMegabytes)) {
+        const QString msg = QString(tr("%1\n(armRecording)")).arg(recordFile->errorString());
         warnAlert(nullptr, msg);
+        delete recordFile;
         return false;
     }
 
-    if (nowRecording) {
-        sf_close(recordFile);
-        const QString msg = QString(tr("Error: starting recording while recording already in progress"));
-        warnAlert(nullptr, msg);
-        return false;
+    // Joins the record thread of any previous take, which might still be using the ring.
+    delete recordThreadController;
+    recordThreadController = NULL;
+    if (recordFile->isCompressed()) {
+        const double ringSeconds = double(ringBufferNumSamps) / (samplingRate * numOutChannels);
+        if (ringSeconds < compressedMinRecordBufferSeconds
+                && !allocateRecordRing(compressedMinRecordBufferSeconds)
+                && !allocateRecordRing(ringSeconds)) {     // make do with what we had
+            delete recordFile;
+            return false;
+        }
     }
 
-    delete recordThreadController;
-    recordThreadController = new RecordThreadController(numOutChannels, &recordRingBuffer, recordFile, transferBuffer);
+    const int ringMsec = int((1000.0 * ringBufferNumSamps) / (samplingRate * numOutChannels));
+    const int drainInterval = qBound(1, ringMsec / 4, maxRecordDrainInterval);
+    recordThreadController = new RecordThreadController(numOutChannels, &recordRingBuffer, recordFile, drainInterval);
     PaUtil_FlushRingBuffer(&recordRingBuffer);
-    nowRecording = true;
+    recordOverflowCount = 0;
+    recordDroppedFrames = 0;
+    recordHighWater = 0;
+    recordState = RecordArmed;
     recordThreadController->start();
 
     return true;
 }
 
+// Call right after RTcmix_parseScore() succeeds (and, in Exclusive mode,
+// before starting audio). Does nothing unless armed.
+void Audio::triggerRecording()
+{
+    int expected = RecordArmed;
+    recordState.compare_exchange_strong(expected, RecordTriggered);
+}
+
 void Audio::stopRecording()
 {
-    if (!nowRecording)
+    if (recordState.exchange(RecordIdle) == RecordIdle)
         return;
-    nowRecording = false;
     if (recordThreadController)
         recordThreadController->stop();
 }
 
+// Write the history -- the last <historyLengthSeconds> of output, or whatever
+// has played so far if less -- to a sound file. Copying it out of the ring and
+// writing it both happen on a background thread: at the longest history and
+// most channels, the copy alone is most of a gigabyte. Reports back through
+// historySaved().
+bool Audio::saveHistory(const QString &fileName)
+{
+    if (historyBuffer == NULL)
+        return false;
+    if (historyThreadController) {
+        const QString msg = QString(tr("Still saving the previous history file"));
+        warnAlert(nullptr, msg);
+        return false;
+    }
+    const long long availFrames = qMin(historyFramesWritten.load(std::memory_order_acquire), (long long) historyNumFrames);
+    if (availFrames == 0) {
+        const QString msg = QString(tr("Nothing has played yet, so there is no history to save"));
+        warnAlert(nullptr, msg);
+        return false;
+    }
+
+    // The callback goes on writing while the worker copies, over the oldest
+    // frames. The worker drops any of those it might have reached, allowing for
+    // a callback in progress -- two, in fact, however large they are. When the
+    // host picks the callback size, the stream's output latency is our best
+    // bound on it.
+    long long callbackFrames = qMax(bufferSize, deviceBufferSize);
+    if (deviceBufferSize == 0)
+        callbackFrames = qMax(callbackFrames, (long long) (streamOutputLatency * samplingRate));
+    const long long guardFrames = qMax((long long) (samplingRate / 10), 2 * callbackFrames);
+    if (availFrames <= guardFrames) {
+        const QString msg = QString(tr("Not enough audio history to save yet"));
+        warnAlert(nullptr, msg);
+        return false;
+    }
+
+    RecordFile *historyFile = new RecordFile();
+    if (!historyFile->open(fileName, int(samplingRate), numOutChannels, recordBitDepth)) {
+        const QString msg = QString(tr("%1\n(saveHistory)")).arg(historyFile->errorString());
+        warnAlert(nullptr, msg);
+        delete historyFile;
+        return false;
+    }
+    historyThreadController = new HistoryThreadController(historyBuffer, historyNumFrames, numOutChannels,
+                                                          &historyFramesWritten, guardFrames, historyFile);
+    CHECKED_CONNECT(historyThreadController, &HistoryThreadController::finished, this, &Audio::historyFinished);
+    historyThreadController->start();
+    return true;
+}
+
+void Audio::historyFinished(bool ok, const QString &message)
+{
+    delete historyThreadController;     // joins the thread
+    historyThreadController = NULL;
+    emit historySaved(ok, message);
+}
+
+// Return counters describing how close the record thread came to losing audio
+// during the current or most recent take.
+Audio::RecordStats Audio::recordStats() const
+{
+    RecordStats stats;
+    stats.overflows = recordOverflowCount;
+    stats.droppedFrames = recordDroppedFrames;
+    stats.highWaterSamps = recordHighWater;
+    stats.capacitySamps = ringBufferNumSamps;
+    stats.capacitySeconds = double(ringBufferNumSamps) / (samplingRate * numOutChannels);
+    return stats;
+}
+
 
 // --------------------------------------------------------------------------
 // Device discovery and info
@@ -462,6 +1107,7 @@ void Audio::stopRecording()
 // QVector is owned by caller.
 int availableAudioApiIDs(QVector<PaHostApiIndex> &idList)
 {
+    QMutexLocker locker(&portAudioMutex);
     PaHostApiIndex numAPIs = Pa_GetHostApiCount();
     if (numAPIs < 0) {
         const QString msg = QString(QObject::tr("Error finding available audio host APIs\n(availableAudioAPIIDs: no audio API IDs discovered)"));
@@ -490,6 +1136,7 @@ int availableAudioApiIDs(QVector<PaHostApiIndex> &idList)
 // QVector is owned by caller.
 int availableInputDeviceIDs(QVector<PaDeviceIndex> &idList)
 {
+    QMutexLocker locker(&portAudioMutex);
     PaDeviceIndex numDevices = Pa_GetDeviceCount();
     if (numDevices < 0) {
         const QString msg = QString(QObject::tr("Error finding available audio input devices\n(availableInputDeviceIDs: no device IDs discovered)"));
@@ -520,6 +1167,7 @@ int availableInputDeviceIDs(QVector<PaDeviceIndex> &idList)
 // QVector is owned by caller.
 int availableOutputDeviceIDs(QVector<PaDeviceIndex> &idList)
 {
+    QMutexLocker locker(&portAudioMutex);
     PaDeviceIndex numDevices = Pa_GetDeviceCount();
     if (numDevices < 0) {
         const QString msg = QString(QObject::tr("Error finding available audio output devices\n(availableOutputDeviceIDs: no device IDs discovered)"));
@@ -560,6 +1208,7 @@ PaDeviceIndex defaultOutputDevice()
 
 PaHostApiIndex audioApiIdFromName(const QString &name)
 {
+    QMutexLocker locker(&portAudioMutex);
     const PaHostApiInfo *apiInfo;
     PaHostApiIndex numAPIs = Pa_GetHostApiCount();
     for (PaHostApiIndex id = 0; id < numAPIs; id++) {
@@ -579,6 +1228,7 @@ PaHostApiIndex audioApiIdFromName(const QString &name)
 // with the given API ID. Return -1 if error, 0 if not.
 int audioApiNameFromId(const PaHostApiIndex apiID, QString &name)
 {
+    QMutexLocker locker(&portAudioMutex);
     const PaHostApiInfo *apiInfo = Pa_GetHostApiInfo(apiID);
     if (apiInfo == NULL) {
         const QString msg = QString(QObject::tr("Error getting information for audio API %1\n(audioApiNameFromId)")).arg(apiID);
@@ -591,6 +1241,7 @@ int audioApiNameFromId(const PaHostApiIndex apiID, QString &name)
 
 PaDeviceIndex deviceIdFromName(const QString &name)
 {
+    QMutexLocker locker(&portAudioMutex);
     const PaDeviceInfo *deviceInfo;
     PaDeviceIndex numDevices = Pa_GetDeviceCount();
     for (PaDeviceIndex id = 0; id < numDevices; id++) {
@@ -610,6 +1261,7 @@ PaDeviceIndex deviceIdFromName(const QString &name)
 // with the given device ID. Return -1 if error, 0 if not.
 int deviceNameFromId(const PaDeviceIndex deviceID, QString &name)
 {
+    QMutexLocker locker(&portAudioMutex);
     const PaDeviceInfo *deviceInfo = Pa_GetDeviceInfo(deviceID);
     if (deviceInfo == NULL) {
         const QString msg = QString(QObject::tr("Error getting information for audio device %1\n(deviceNameFromId)")).arg(deviceID);
@@ -636,26 +1288,34 @@ int maxOutputChannelCount(const PaDeviceIndex deviceID)
 
 // Return number of available sampling rates, if any, that are valid for the
 // given device ID and output channel count. Pass back QVector of valid
-// sampling rates, which is owned by caller.
+// sampling rates, which is owned by caller. Answers come from the device
+// cache when it has them (see devicecache.h), and go into it when it doesn't.
 // NB: This gives us many rates as valid for the MOTU 1248 that probably aren't.
 int availableSamplingRates(const PaDeviceIndex deviceID, const int numOutputChannels, QVector<int> &rates)
 {
-    PaStreamParameters outParams;
-    memset(&outParams, 0, sizeof(outParams));
-    outParams.channelCount = numOutputChannels;
-    outParams.device = deviceID;
-    outParams.sampleFormat = paFloat32;
+    if (cachedSamplingRates(deviceID, numOutputChannels, rates))
+        return rates.size();
+    const int count = probeSamplingRates(deviceID, numOutputChannels, rates);
+    cacheSamplingRates(deviceID, numOutputChannels, rates);
+    return count;
+}
 
-    static int standardSamplingRates[] = { 44100, 48000, 88200, 96000, 176400, 192000, -1 };
-    int count = 0;
-    for (int i = 0; standardSamplingRates[i] > 0; i++) {
-        PaError err = Pa_IsFormatSupported(NULL, &outParams, standardSamplingRates[i]);
-        if (err == paFormatIsSupported) {
-            rates.append(standardSamplingRates[i]);
-            count++;
-        }   // we don't report an err, because the point is to exclude invalid rates silently
+PaTime suggestedLatency(const PaDeviceIndex deviceID, bool output, int profile)
+{
+    QMutexLocker locker(&portAudioMutex);
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(deviceID);
+    if (info == NULL)
+        return 0.0;     // the host's minimum
+    const PaTime low = output ? info->defaultLowOutputLatency : info->defaultLowInputLatency;
+    const PaTime high = output ? info->defaultHighOutputLatency : info->defaultHighInputLatency;
+    switch (profile) {
+    case LatencyBalanced:
+        return (low + high) / 2.0;
+    case LatencySafe:
+        return high;
+    default:
+        return low;
     }
-    return count;
 }
 
 // Return number of available buffer sizes, if any, that are valid for the
@@ -4,15 +4,22 @@
 
 #include <atomic>
 #include <QObject>
+#include <QVector>
 
 QT_BEGIN_NAMESPACE
 class QString;
 class QTimer;
 QT_END_NAMESPACE
+class DspLoadMeter;
+class HistoryThreadController;
 class MainWindow;
+class MeterBridge;
 class RecordThreadController;
+class RenderAheadThreadController;
+class TruePeakThreadController;
 class Preferences;
 
+#include "clipdetect.h"
 #include "portaudio.h"
 #include "pa_ringbuffer.h"
 #include "sndfile.h"
@@ -32,22 +39,64 @@ int maxOutputChannelCount(const PaDeviceIndex);
 int availableSamplingRates(const PaDeviceIndex, const int, QVector<int> &);
 int availableBufferSizes(const PaDeviceIndex, QVector<int> &);
 
+// How much latency to ask the host API for, from the device's own defaults.
+enum LatencyProfile { LatencyLowest, LatencyBalanced, LatencySafe };
+PaTime suggestedLatency(const PaDeviceIndex, bool output, int profile);
+
+// Limits on the stream preferences, shared by the preferences dialog and Audio.
+// The record ring buffer size is in seconds of audio at the current sampling
+// rate and channel count.
+const double minRecordBufferSeconds = 0.25;
+const double maxRecordBufferSeconds = 60.0;
+const int maxHistorySeconds = 600;
+const int maxRenderAheadBlocks = 8;
+
 class Audio : public QObject
 {
     Q_OBJECT
 
 public:
+    struct RecordStats {
+        int overflows;              // callbacks whose output was dropped
+        long long droppedFrames;
+        int highWaterSamps;         // max ring buffer fill
+        int capacitySamps;
+        double capacitySeconds;
+    };
+
     Audio();
     ~Audio();
     int reinitializeRTcmix(bool interactive=false);
+    void releaseRTcmix();
     int startAudio();
-    bool startRecording(const QString &);
+    bool armRecording(const QString &);
+    void triggerRecording();
     void stopRecording();
+    RecordStats recordStats() const;
+    bool historyEnabled() const { return historyBuffer != NULL; }
+    int historySeconds() const { return historyLengthSeconds; }
+    bool saveHistory(const QString &);
+    // Actual latencies of the open stream, in seconds (0 if none)
+    double outputLatency() const { return streamOutputLatency; }
+    double inputLatency() const { return streamInputLatency; }
+    void markScoreStart();
+    bool reconfigure();
 
 private:
+    void readStreamPreferences();
     int initializeAudio();
+    PaError openStream();
+    void closeStream();
+    void allocateStreamBuffers();
+    void allocateHistory();
     int initializeRTcmix(bool interactive=false);
     int stopAudio();
+    bool allocateRecordRing(double seconds);
+    void startRenderAhead();
+    void stopRenderAhead();
+    void copyRenderedAhead(float *output, unsigned long frameCount);
+    void runAdapted(float *output, unsigned long frameCount);
+    void checkTruePeaks();
 
     // We use a static method wrapper for our callback to make portaudio work from C++,
     // as described here: https://app.assembla.com/wiki/show/portaudio/Tips_CPlusPlus .
@@ -79,28 +128,126 @@ private:
     float samplingRate;
     int numInChannels;
     int numOutChannels;
-    int bufferSize;
+    int bufferSize;             // RTcmix vector size
     int busCount;
+    int latencyProfile;
+    double streamOutputLatency;
+    double streamInputLatency;
+    bool latencyLogged;
+    int deviceBufferSize;       // frames per callback: <bufferSize>, or 0 for whatever the host likes
+
+    // When the device's callbacks aren't bufferSize frames, RTcmix fills
+    // adapterBlock a whole vector at a time, and callbacks take frames from it.
+    float *adapterBlock;
+    long adapterOffset;         // callback only: frames already used; bufferSize means empty
 
     MainWindow *mainWindow;
+    double recordBufferSeconds;
+    int recordBitDepth;
+    int recordSegmentMinutes;
+    int recordSegmentMegabytes;
+    bool recordSplitChannels;
+    int ringBufferNumSamps;
     PaUtilRingBuffer recordRingBuffer;
-    SNDFILE *recordFile;
     float *recordBuffer;
-    float *transferBuffer;
     RecordThreadController *recordThreadController;
-    std::atomic<bool> nowRecording;
+    // Armed: file and record thread ready, waiting for triggerRecording().
+    // Triggered: the next callback to start switches to On and records its buffer.
+    enum RecordState { RecordIdle, RecordArmed, RecordTriggered, RecordOn };
+    std::atomic<int> recordState;
+    std::atomic<int> recordOverflowCount;
+    std::atomic<long long> recordDroppedFrames;
+    std::atomic<int> recordHighWater;
+
+    // Always-on circular copy of the output, for Save Last Seconds. Only the
+    // callback writes to it; historyFramesWritten counts every frame it ever wrote.
+    int historyLengthSeconds;
+    float *historyBuffer;
+    long historyNumFrames;
+    std::atomic<long long> historyFramesWritten;
+    HistoryThreadController *historyThreadController;
+    // Underflow, overflow and priming events from the callback's statusFlags,
+    // with the stream time and the frame position where they happened. The
+    // counts are kept apart from the ring, so they stay right if it fills.
+    struct XrunEvent {
+        PaStreamCallbackFlags flags;
+        double streamTime;          // PortAudio's DAC time for the buffer
+        long long frame;            // streamFrames at the start of the buffer
+    };
+    static const int xrunRingSize = 64;     // events; a power of 2
+    XrunEvent xrunEvents[xrunRingSize];
+    PaUtilRingBuffer xrunRingBuffer;
+    std::atomic<int> outputUnderflows;
+    std::atomic<int> outputOverflows;
+    std::atomic<int> primingBuffers;
+    std::atomic<int> xrunEventsLost;
+    std::atomic<long long> streamFrames;    // frames the callback has produced
+    long long scoreStartFrame;              // streamFrames when the score started, or -1
+    int reportedUnderflows;
+    int reportedOverflows;
+    // Real-time hardening (see rthardening.h). The callback applies its part at
+    // the first buffer after each start, since the stream may get a new thread.
+    bool rtHardening;
+    int rtPriority;
+    int rtCPU;                              // < 0 for any
+    int memoryLockResult;
+    std::atomic<bool> hardenPending;
+    std::atomic<bool> hardeningDone;        // results below are ready to report
+    bool hardeningLogged;
+    int threadPriorityResult;
+    int threadCPUResult;
+    bool flushDenormalsResult;
+    // Render-ahead mode (see renderahead.h): a queue of <renderAheadBlocks>
+    // blocks of bufferSize frames, filled by the render thread.
+    int renderAheadBlocks;                  // 0 for off
+    float *renderAheadBuffer;
+    PaUtilRingBuffer renderAheadQueue;
+    RenderAheadThreadController *renderAheadThreadController;
+    long renderAheadOffset;                 // callback only: frames already used from the oldest block
+    std::atomic<int> renderAheadMisses;     // callbacks that found the queue empty
+    DspLoadMeter *dspLoad;
+    QTimer *dspLoadTimer;
     std::atomic<bool> detectClipping;
+    ClipDetectFunction clipDetect;
     int *consecutiveSamps;
     std::atomic<int> *clippingCounts;
     QTimer *clippingTimer;
+    MeterBridge *meterBridge;
+    QTimer *meterTimer;
+    QVector<float> meterPeak;
+    QVector<float> meterRMS;
+    QVector<float> meterPeakHold;
+
+    // True peak is measured on its own thread, from a ring of whole output
+    // frames; truePeaks holds the per-channel max since checkMeters last took it.
+    PaUtilRingBuffer truePeakRingBuffer;
+    float *truePeakBuffer;
+    std::atomic<float> *truePeaks;
+    TruePeakThreadController *truePeakThreadController;
+    QVector<float> truePeakMax;     // since startAudio
+    bool truePeakMaxReset;
 
     Preferences *audioPreferences;
 
 private slots:
     void checkClipping();
+    void checkMeters();
+    void checkDspLoad();
+    void checkXruns();
+    void checkHardening();
+    void checkLatency();
+    void historyFinished(bool, const QString &);
 
 signals:
     void didClip(int clipCount);
+    void meterLevels(const QVector<float> &peak, const QVector<float> &rms, const QVector<float> &peakHold);
+    void truePeakLevels(const QVector<float> &maxTruePeak);
+    // Fractions of the buffer period spent in RTcmix_runAudio; all < 0 when stopped.
+    void dspLoadChanged(float min, float avg, float p99, float max);
+    void xrunCountsChanged(int underflows, int overflows);
+    void xrunLogged(const QString &message);
+    void audioMessage(const QString &message);
+    void historySaved(bool ok, const QString &message);
 
 #ifdef NOTYET   // should move to main window
     // Owned by layout
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSet>
+#include <QTextStream>
+#include <QTimer>
+#include <QtDebug>
+
+#include "batchrender.h"
+#include "utils.h"
+
+// Batch exit status, matching the headless render exit codes in main.cpp.
+const int batchExitOK = 0;
+const int batchExitFailures = 3;
+
+// Pass back the scores named by <path>, which may be a directory (all the
+// .sco files in it), a single .sco file, or a text file listing one score
+// per line (relative to the list file; blank lines and #-comments skipped).
+// Return the number of scores found, or -1 if <path> can't be read.
+int collectBatchScores(const QString &path, QStringList &scores)
+{
+    QFileInfo info(path);
+    if (info.isDir()) {
+        QDir dir(path);
+        const QStringList names = dir.entryList(QStringList() << "*.sco", QDir::Files, QDir::Name);
+        foreach (const QString &name, names)
+            scores.append(dir.filePath(name));
+        return int(names.size());
+    }
+    if (path.endsWith(".sco")) {
+        if (!info.isReadable())
+            return -1;
+        scores.append(path);
+        return 1;
+    }
+
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly | QFile::Text))
+        return -1;
+    QDir listDir = info.dir();
+    QTextStream in(&file);
+    int count = 0;
+    while (!in.atEnd()) {
+        const QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+        scores.append(QDir::cleanPath(listDir.absoluteFilePath(line)));
+        count++;
+    }
+    return count;
+}
+
+
+BatchRenderer::BatchRenderer(const QStringList &scores, const QString &outputDir, const QString &extension,
+                             const QStringList &renderArgs, int numWorkers, int timeoutSecs)
+    : outputDir(outputDir)
+    , extension(extension)
+    , renderArgs(renderArgs)
+    , numWorkers(qMax(1, numWorkers))
+    , timeoutSecs(timeoutSecs)
+    , numJobs(int(scores.size()))
+    , numFailed(0)
+    , reported(false)
+{
+    foreach (const QString &score, scores)
+        pending.enqueue(score);
+}
+
+BatchRenderer::~BatchRenderer()
+{
+    // Only reached with jobs running if the event loop quits out from under us.
+    foreach (Job *job, running) {
+        job->process->disconnect(this);
+        job->process->kill();
+        job->process->waitForFinished();
+        delete job;
+    }
+}
+
+// Call this before entering the event loop. Jobs are launched from there.
+void BatchRenderer::start()
+{
+    batchClock.start();
+    QTimer::singleShot(0, this, &BatchRenderer::launchJobs);
+}
+
+void BatchRenderer::launchJobs()
+{
+    while (running.size() < numWorkers && !pending.isEmpty()) {
+        Job *job = new Job;
+        job->score = pending.dequeue();
+        job->output = outputFileName(job->score);
+        job->timedOut = false;
+
+        job->process = new QProcess(this);
+        CHECKED_CONNECT(job->process, &QProcess::finished, this, &BatchRenderer::jobFinished);
+        CHECKED_CONNECT(job->process, &QProcess::errorOccurred, this, &BatchRenderer::jobFailedToStart);
+
+        job->timer = new QTimer(job->process);
+        job->timer->setSingleShot(true);
+        CHECKED_CONNECT(job->timer, &QTimer::timeout, this, &BatchRenderer::jobTimedOut);
+
+        running.insert(job->process, job);
+
+        QStringList args;
+        args << "--render" << job->score << "-o" << job->output << renderArgs;
+        job->clock.start();
+        // Start the timer first: if the process fails to start, finishJob()
+        // deletes the job before start() returns.
+        if (timeoutSecs > 0)
+            job->timer->start(timeoutSecs * 1000);
+        job->process->start(QCoreApplication::applicationFilePath(), args);
+    }
+    if (running.isEmpty() && pending.isEmpty())
+        report();
+}
+
+// Scores from different directories can have the same name. Give each one
+// after the first a numbered suffix ("name-2.wav"), rather than let them
+// overwrite each other. (Compared without case, for case-insensitive disks.)
+QString BatchRenderer::outputFileName(const QString &score)
+{
+    const QString baseName = QFileInfo(score).completeBaseName();
+    QString name = baseName + "." + extension;
+    for (int n = 2; outputNames.contains(name.toLower()); n++)
+        name = QString("%1-%2.%3").arg(baseName, QString::number(n), extension);
+    if (!name.startsWith(baseName + "."))
+        fprintf(stderr, "%s: output renamed to %s\n", qPrintable(score), qPrintable(name));
+    outputNames.insert(name.toLower());
+    return QDir(outputDir).filePath(name);
+}
+
+void BatchRenderer::jobFinished(int exitCode, QProcess::ExitStatus exitStatus)
+{
+    Job *job = running.value(qobject_cast<QProcess *>(sender()));
+    if (job == NULL)
+        return;
+    QString status;
+    if (job->timedOut)
+        status = "timeout";
+    else if (exitStatus == QProcess::CrashExit)
+        status = "crashed";
+    else if (exitCode == 0)
+        status = "ok";
+    else if (exitCode == 2)
+        status = "parse-error";
+    else
+        status = "render-error";
+    finishJob(job, exitCode, status);
+}
+
+void BatchRenderer::jobFailedToStart(QProcess::ProcessError error)
+{
+    // Other errors are followed by finished(), which we handle there.
+    if (error != QProcess::FailedToStart)
+        return;
+    Job *job = running.value(qobject_cast<QProcess *>(sender()));
+    if (job)
+        finishJob(job, -1, "failed-to-start");
+}
+
+void BatchRenderer::jobTimedOut()
+{
+    Job *job = running.value(qobject_cast<QProcess *>(sender()->parent()));
+    if (job == NULL)
+        return;
+    job->timedOut = true;
+    job->process->kill();       // finished() arrives when it's gone
+}
+
+void BatchRenderer::finishJob(Job *job, int exitCode, const QString &status)
+{
+    running.remove(job->process);
+    job->timer->stop();
+
+    // The child prints its own one-line JSON summary as the last line of stdout.
+    QJsonObject result;
+    const QList<QByteArray> lines = job->process->readAllStandardOutput().trimmed().split('\n');
+    QJsonDocument doc = QJsonDocument::fromJson(lines.last());
+    if (doc.isObject())
+        result = doc.object();
+    result["score"] = job->score;
+    result["output"] = job->output;
+    result["status"] = status;
+    result["exitCode"] = exitCode;
+    result["wallclock"] = job->clock.nsecsElapsed() / 1.0e9;
+    if (status != "ok") {
+        numFailed++;
+        if (!result.contains("error")) {
+            const QString err = QString::fromLocal8Bit(job->process->readAllStandardError()).trimmed();
+            result["error"] = err.section('\n', -1);
+        }
+    }
+    results.append(result);
+    fprintf(stderr, "[%d/%d] %s: %s\n", int(results.size()), numJobs, qPrintable(job->score), qPrintable(status));
+
+    job->process->deleteLater();
+    delete job;
+
+    launchJobs();
+}
+
+void BatchRenderer::report()
+{
+    if (reported)   // a job can fail synchronously inside launchJobs()
+        return;
+    reported = true;
+
+    const double elapsed = batchClock.nsecsElapsed() / 1.0e9;
+    double audioSeconds = 0.0;
+    for (int i = 0; i < results.size(); i++)
+        audioSeconds += results.at(i).toObject().value("seconds").toDouble();
+
+    QJsonObject summary;
+    summary["jobs"] = results;
+    summary["total"] = numJobs;
+    summary["ok"] = numJobs - numFailed;
+    summary["failed"] = numFailed;
+    summary["workers"] = numWorkers;
+    summary["elapsed"] = elapsed;
+    summary["seconds"] = audioSeconds;
+    summary["realtime"] = (elapsed > 0.0) ? audioSeconds / elapsed : 0.0;
+    fprintf(stdout, "%s\n", QJsonDocument(summary).toJson(QJsonDocument::Compact).constData());
+    fflush(stdout);
+
+    QCoreApplication::exit(numFailed ? batchExitFailures : batchExitOK);
+}
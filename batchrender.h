@@ -0,0 +1,70 @@
+#ifndef BATCHRENDER_H
+#define BATCHRENDER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonArray>
+#include <QObject>
+#include <QProcess>
+#include <QQueue>
+#include <QSet>
+#include <QStringList>
+
+QT_BEGIN_NAMESPACE
+class QTimer;
+QT_END_NAMESPACE
+
+int collectBatchScores(const QString &, QStringList &);
+
+// RTcmix is a process-global singleton, so we can only render one score per
+// process. To render a whole library of scores in parallel, we farm them out
+// to a pool of child processes, each running this program with --render.
+// When the queue drains, we print an aggregated JSON report to stdout and
+// exit the event loop with a status that says whether every job succeeded.
+
+class BatchRenderer : public QObject
+{
+    Q_OBJECT
+
+public:
+    BatchRenderer(const QStringList &scores, const QString &outputDir, const QString &extension,
+                  const QStringList &renderArgs, int numWorkers, int timeoutSecs);
+    ~BatchRenderer();
+    void start();
+
+private slots:
+    void jobFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void jobFailedToStart(QProcess::ProcessError error);
+    void jobTimedOut();
+
+private:
+    struct Job {
+        QString score;
+        QString output;
+        QProcess *process;
+        QTimer *timer;
+        QElapsedTimer clock;
+        bool timedOut;
+    };
+
+    void launchJobs();
+    QString outputFileName(const QString &score);
+    void finishJob(Job *, int exitCode, const QString &status);
+    void report();
+
+    QQueue<QString> pending;
+    QSet<QString> outputNames;          // lowercased, to catch collisions
+    QHash<QProcess *, Job *> running;   // keyed by the process, which is also its timer's parent
+    QJsonArray results;
+    QString outputDir;
+    QString extension;
+    QStringList renderArgs;
+    int numWorkers;
+    int timeoutSecs;
+    int numJobs;
+    int numFailed;
+    bool reported;
+    QElapsedTimer batchClock;
+};
+
+#endif // BATCHRENDER_H
@@ -0,0 +1,238 @@
+#include "blockwriter.h"
+
+#ifdef USE_BLOCK_WRITER
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <QObject>
+#include <QtDebug>
+
+const sf_count_t writeBufferSize = 1024 * 1024;         // bytes
+const sf_count_t writeAlignment = 4096;                 // file offset alignment of flushed blocks
+const sf_count_t preallocationChunkSize = 32 * 1024 * 1024;
+
+
+BlockFileWriter::BlockFileWriter()
+    : fd(-1)
+    , buffer(NULL)
+    , bufferOffset(0)
+    , bufferFill(0)
+    , position(0)
+    , length(0)
+    , allocated(0)
+    , canPreallocate(true)
+    , failed(false)
+{
+}
+
+BlockFileWriter::~BlockFileWriter()
+{
+    close();
+    free(buffer);
+}
+
+bool BlockFileWriter::open(const QString &fileName)
+{
+    void *mem = NULL;
+    if (posix_memalign(&mem, writeAlignment, writeBufferSize) != 0) {
+        errorText = QString(QObject::tr("Can't allocate record file buffer"));
+        return false;
+    }
+    buffer = (char *) mem;
+
+    QByteArray ba = fileName.toLocal8Bit();
+    fd = ::open(ba.data(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        errorText = QString(QObject::tr("Error opening sound file for recording\n(open: %1)")).arg(strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+SNDFILE *BlockFileWriter::openSoundFile(SF_INFO *sfinfo)
+{
+    static SF_VIRTUAL_IO vio = { vioGetFileLen, vioSeek, vioRead, vioWrite, vioTell };
+    SNDFILE *sndFile = sf_open_virtual(&vio, SFM_WRITE, sfinfo, this);
+    if (sndFile == NULL)
+        errorText = QString(QObject::tr("Error opening sound file for recording\n(sf_open_virtual: %1)")).arg(sf_strerror(NULL));
+    return sndFile;
+}
+
+// Write out everything we've buffered.
+bool BlockFileWriter::flush()
+{
+    if (bufferFill == 0)
+        return !failed;
+    bool ok = writeAll(buffer, bufferFill, bufferOffset);
+    bufferOffset += bufferFill;
+    bufferFill = 0;
+    return ok;
+}
+
+// Write out as much of the buffer as ends on an aligned file offset,
+// and keep the rest for next time.
+bool BlockFileWriter::flushAligned()
+{
+    const sf_count_t alignedEnd = (bufferOffset + bufferFill) & ~(writeAlignment - 1);
+    if (alignedEnd <= bufferOffset)
+        return flush();
+    const sf_count_t count = alignedEnd - bufferOffset;
+    bool ok = writeAll(buffer, count, bufferOffset);
+    memmove(buffer, buffer + count, size_t(bufferFill - count));
+    bufferOffset = alignedEnd;
+    bufferFill -= count;
+    return ok;
+}
+
+bool BlockFileWriter::close()
+{
+    if (fd < 0)
+        return true;
+    bool ok = flush();
+    releasePreallocated();
+    if (::close(fd) != 0)
+        ok = false;
+    fd = -1;
+    return ok;
+}
+
+bool BlockFileWriter::writeAll(const char *src, sf_count_t count, sf_count_t offset)
+{
+    if (failed)
+        return false;
+    preallocate(offset + count);
+    while (count > 0) {
+        ssize_t n = pwrite(fd, src, size_t(count), off_t(offset));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            qDebug("BlockFileWriter::writeAll(): pwrite failed: %s", strerror(errno));
+            failed = true;
+            return false;
+        }
+        src += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
+
+// Reserve disk space in big chunks ahead of the data. FALLOC_FL_KEEP_SIZE means
+// the reserved space doesn't count in the file size, so a crashed recording
+// still ends at its last sample. It does stay allocated, though, until we give
+// it back in releasePreallocated().
+void BlockFileWriter::preallocate(sf_count_t end)
+{
+#ifdef Q_OS_LINUX
+    if (!canPreallocate || end <= allocated)
+        return;
+    const sf_count_t newAllocated = ((end / preallocationChunkSize) + 1) * preallocationChunkSize;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, off_t(allocated), off_t(newAllocated - allocated)) == 0)
+        allocated = newAllocated;
+    else
+        canPreallocate = false;     // e.g., filesystem doesn't support it; just write
+#else
+    Q_UNUSED(end);
+#endif
+}
+
+// Free whatever preallocate() reserved past the end of the file. Truncating to
+// the current length does it; punching a hole doesn't, on ext4 at least, since
+// it stops at the end of the file.
+void BlockFileWriter::releasePreallocated()
+{
+#ifdef Q_OS_LINUX
+    if (allocated <= length)
+        return;
+    if (ftruncate(fd, off_t(length)) != 0)
+        qDebug("BlockFileWriter::releasePreallocated(): %s", strerror(errno));
+    allocated = length;
+#endif
+}
+
+sf_count_t BlockFileWriter::write(const void *ptr, sf_count_t count)
+{
+    // libsndfile seeks back to rewrite the header now and then. Anything not
+    // contiguous with what we've buffered means flushing the buffer first.
+    if (bufferFill > 0 && position != bufferOffset + bufferFill) {
+        if (!flush())
+            return 0;
+    }
+    if (bufferFill == 0)
+        bufferOffset = position;
+
+    const char *src = (const char *) ptr;
+    sf_count_t remaining = count;
+    while (remaining > 0) {
+        const sf_count_t n = qMin(remaining, writeBufferSize - bufferFill);
+        memcpy(buffer + bufferFill, src, size_t(n));
+        bufferFill += n;
+        src += n;
+        remaining -= n;
+        position += n;
+        if (position > length)
+            length = position;
+        if (bufferFill == writeBufferSize && !flushAligned())
+            return count - remaining;
+    }
+    return count;
+}
+
+sf_count_t BlockFileWriter::read(void *ptr, sf_count_t count)
+{
+    if (!flush())
+        return 0;
+    ssize_t n = pread(fd, ptr, size_t(count), off_t(position));
+    if (n < 0)
+        return 0;
+    position += n;
+    return n;
+}
+
+sf_count_t BlockFileWriter::seek(sf_count_t offset, int whence)
+{
+    switch (whence) {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position += offset;
+        break;
+    case SEEK_END:
+        position = length + offset;
+        break;
+    default:
+        return -1;
+    }
+    return position;
+}
+
+sf_count_t BlockFileWriter::vioGetFileLen(void *userData)
+{
+    return reinterpret_cast<BlockFileWriter *>(userData)->length;
+}
+
+sf_count_t BlockFileWriter::vioSeek(sf_count_t offset, int whence, void *userData)
+{
+    return reinterpret_cast<BlockFileWriter *>(userData)->seek(offset, whence);
+}
+
+sf_count_t BlockFileWriter::vioRead(void *ptr, sf_count_t count, void *userData)
+{
+    return reinterpret_cast<BlockFileWriter *>(userData)->read(ptr, count);
+}
+
+sf_count_t BlockFileWriter::vioWrite(const void *ptr, sf_count_t count, void *userData)
+{
+    return reinterpret_cast<BlockFileWriter *>(userData)->write(ptr, count);
+}
+
+sf_count_t BlockFileWriter::vioTell(void *userData)
+{
+    return reinterpret_cast<BlockFileWriter *>(userData)->position;
+}
+
+#endif // USE_BLOCK_WRITER
@@ -0,0 +1,64 @@
+#ifndef BLOCKWRITER_H
+#define BLOCKWRITER_H
+
+#include <QString>
+#include <QtGlobal>
+#include "sndfile.h"
+
+// On POSIX systems, recordings go through this libsndfile virtual I/O backend
+// instead of letting libsndfile write the file itself. libsndfile hands us the
+// many small, irregular writes it makes for each chunk of audio; we gather
+// them into a large buffer and pwrite() it in big, page-aligned blocks. On
+// Linux, we also reserve disk space for the file ahead of time with fallocate(),
+// so that the filesystem isn't allocating blocks during a take.
+//
+// All of this runs on the record thread, never on the audio callback thread.
+
+#ifndef Q_OS_WIN
+#define USE_BLOCK_WRITER
+#endif
+
+#ifdef USE_BLOCK_WRITER
+
+class BlockFileWriter
+{
+public:
+    BlockFileWriter();
+    ~BlockFileWriter();
+
+    bool open(const QString &fileName);
+    SNDFILE *openSoundFile(SF_INFO *);
+    bool flush();
+    bool close();
+    const QString &errorString() const { return errorText; }
+
+private:
+    static sf_count_t vioGetFileLen(void *);
+    static sf_count_t vioSeek(sf_count_t, int, void *);
+    static sf_count_t vioRead(void *, sf_count_t, void *);
+    static sf_count_t vioWrite(const void *, sf_count_t, void *);
+    static sf_count_t vioTell(void *);
+
+    sf_count_t write(const void *, sf_count_t);
+    sf_count_t read(void *, sf_count_t);
+    sf_count_t seek(sf_count_t, int);
+    bool flushAligned();
+    bool writeAll(const char *, sf_count_t, sf_count_t);
+    void preallocate(sf_count_t);
+    void releasePreallocated();
+
+    int fd;
+    char *buffer;
+    sf_count_t bufferOffset;    // file offset of buffer[0]
+    sf_count_t bufferFill;
+    sf_count_t position;        // libsndfile's idea of the file pointer
+    sf_count_t length;
+    sf_count_t allocated;       // bytes reserved with fallocate()
+    bool canPreallocate;
+    bool failed;
+    QString errorText;
+};
+
+#endif // USE_BLOCK_WRITER
+
+#endif // BLOCKWRITER_H
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <string.h>
+#include <QMutexLocker>
+#include "audio.h"
+#include "buffertuner.h"
+#include "devicecache.h"
+#define EMBEDDEDAUDIO
+#include "RTcmix_API.h"
+
+const double BufferTuner::measureSeconds = 3.0;
+const float BufferTuner::maxPassingLoad = 0.7f;
+const double settleSeconds = 0.5;     // ignore startup, when some hosts prime or stall
+
+BufferTuner::BufferTuner(PaDeviceIndex outputDeviceID, float samplingRate, int numOutChannels, int busCount, int latencyProfile)
+    : outputDeviceID(outputDeviceID)
+    , samplingRate(samplingRate)
+    , numOutChannels(numOutChannels)
+    , busCount(busCount)
+    , latencyProfile(latencyProfile)
+    , cancelled(false)
+    , measuring(false)
+    , period(0.0)
+    , dspLoad(NULL)
+{
+}
+
+int BufferTuner::initializeRTcmix(int bufferSize)
+{
+    int status = RTcmix_init();
+    if (status != 0) {
+        errorText = QString(QObject::tr("Error initializing RTcmix\n(RTcmix_init: %1)")).arg(status);
+        return status;
+    }
+    status = RTcmix_setAudioBufferFormat(AudioFormat_32BitFloat_Normalized, numOutChannels);
+    if (status == 0)
+        status = RTcmix_setparams(samplingRate, numOutChannels, bufferSize, 0, busCount);
+    if (status != 0) {
+        errorText = QString(QObject::tr("Error configuring RTcmix\n(BufferTuner: %1)")).arg(status);
+        RTcmix_destroy();
+    }
+    return status;
+}
+
+// Same work as Audio::memberCallback minus the metering: RTcmix with no score.
+int BufferTuner::memberCallback(void *output, unsigned long frameCount, PaStreamCallbackFlags statusFlags)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    RTcmix_runAudio(NULL, output, int(frameCount));
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    if (measuring.load(std::memory_order_acquire)) {
+        const std::chrono::duration<double> runTime = end - start;
+        dspLoad->add(runTime.count() / period);
+        if (statusFlags & paOutputUnderflow)
+            underflows++;
+        if (haveLastCallback) {
+            const std::chrono::duration<double> interval = start - lastCallback;
+            const double jitter = fabs(interval.count() - period);
+            jitterSum += jitter;
+            if (jitter > maxJitter)
+                maxJitter = jitter;
+            intervals++;
+        }
+        lastCallback = start;
+        haveLastCallback = true;
+    }
+    return paContinue;
+}
+
+BufferTuner::Result BufferTuner::measure(int bufferSize)
+{
+    Result result;
+    memset(&result, 0, sizeof(result));
+    result.bufferSize = bufferSize;
+    errorText.clear();
+
+    QMutexLocker locker(&portAudioMutex);
+    PaError err = Pa_Initialize();
+    if (err != paNoError) {
+        errorText = QString(QObject::tr("Error initializing audio system\n(Pa_Initialize: %1)")).arg(Pa_GetErrorText(err));
+        return result;
+    }
+    if (initializeRTcmix(bufferSize) != 0) {
+        Pa_Terminate();
+        return result;
+    }
+
+    PaStreamParameters outputParameters;
+    memset(&outputParameters, 0, sizeof(outputParameters));
+    outputParameters.channelCount = numOutChannels;
+    outputParameters.device = outputDeviceID;
+    outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = suggestedLatency(outputDeviceID, true, latencyProfile);
+
+    DspLoadMeter load;
+    dspLoad = &load;
+    period = bufferSize / samplingRate;
+    measuring = false;
+    haveLastCallback = false;
+    underflows = 0;
+    intervals = 0;
+    jitterSum = 0.0;
+    maxJitter = 0.0;
+
+    PaStream *stream = NULL;
+    err = Pa_OpenStream(&stream, NULL, &outputParameters, samplingRate, bufferSize,
+                                paClipOff | paDitherOff, &paCallback, this);
+    locker.unlock();        // not for the whole measurement
+    if (err == paNoError)
+        err = Pa_StartStream(stream);
+    if (err == paNoError) {
+        result.opened = true;
+        QThread::msleep(ulong(settleSeconds * 1000.0));
+        load.reset();
+        measuring.store(true, std::memory_order_release);
+        // Sleep in slices, so Cancel doesn't take the whole measurement time.
+        for (int msec = 0; msec < measureSeconds * 1000.0 && !cancelled; msec += 100)
+            QThread::msleep(100);
+        Pa_StopStream(stream);      // after this, the callback's fields are ours
+        measuring = false;
+
+        const DspLoadMeter::Stats stats = load.read();
+        result.underflows = underflows;
+        result.meanJitter = intervals ? 1000.0 * jitterSum / intervals : 0.0;
+        result.maxJitter = 1000.0 * maxJitter;
+        result.p99Load = stats.p99;
+        result.maxLoad = stats.max;
+        result.passed = !cancelled && stats.callbacks > 0 && underflows == 0 && stats.p99 <= maxPassingLoad;
+    }
+    else
+        errorText = QString(QObject::tr("Could not open the device with a %1-frame buffer (%2)")).arg(bufferSize).arg(Pa_GetErrorText(err));
+    locker.relock();
+    if (stream)
+        Pa_CloseStream(stream);
+    dspLoad = NULL;
+    RTcmix_destroy();
+    Pa_Terminate();
+    return result;
+}
+
+QString BufferTuner::describe(const Result &result)
+{
+    if (!result.opened)
+        return QString(QObject::tr("Buffer size %1: could not open the device")).arg(result.bufferSize);
+    return QString(QObject::tr("Buffer size %1: %2 underflows, callback jitter %3 ms mean, %4 ms max, "
+                               "RTcmix load %5% p99, %6% max -- %7"))
+            .arg(result.bufferSize)
+            .arg(result.underflows)
+            .arg(result.meanJitter, 0, 'f', 2)
+            .arg(result.maxJitter, 0, 'f', 2)
+            .arg(qRound(result.p99Load * 100.0f))
+            .arg(qRound(result.maxLoad * 100.0f))
+            .arg(result.passed ? QObject::tr("OK") : QObject::tr("too risky"));
+}
+
+
+// --------------------------------------------------------------------------
+
+// Try each size, smallest first, and stop at the first one that passes.
+void BufferTunerWorker::tune()
+{
+    int bestSize = 0;
+    for (int i = 0; i < sizes.size() && !tuner->isCancelled(); i++) {
+        emit progress(i, sizes[i]);
+        const BufferTuner::Result result = tuner->measure(sizes[i]);
+        QString report = BufferTuner::describe(result);
+        if (!result.opened && !tuner->errorString().isEmpty())
+            report = tuner->errorString();
+        emit measured(report);
+        if (result.passed) {
+            bestSize = sizes[i];
+            break;
+        }
+    }
+    emit finished(bestSize);
+}
@@ -0,0 +1,128 @@
+#ifndef BUFFERTUNER_H
+#define BUFFERTUNER_H
+
+#include <atomic>
+#include <chrono>
+#include <QObject>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include "dspload.h"
+#include "portaudio.h"
+#include "utils.h"
+
+// Find Best Buffer Size: open the output device at each candidate buffer
+// size in turn, smallest first, with RTcmix running but no score, and watch
+// it for a few seconds. A size passes if the device reports no underflows
+// and RTcmix leaves enough of each buffer period free for a real score. The
+// first size that passes is the recommendation.
+//
+// Like OfflineRenderer, this needs RTcmix to itself, and PortAudio too: the
+// caller must close the Audio object first.
+
+class BufferTuner
+{
+public:
+    struct Result {
+        int bufferSize;
+        bool opened;                // false if the device refused this size
+        int underflows;
+        double meanJitter;          // mean deviation of callback intervals from the period, msec
+        double maxJitter;           // msec
+        float p99Load;              // fraction of the period spent in RTcmix
+        float maxLoad;
+        bool passed;
+    };
+
+    BufferTuner(PaDeviceIndex outputDeviceID, float samplingRate, int numOutChannels, int busCount, int latencyProfile);
+
+    Result measure(int bufferSize);
+    static QString describe(const Result &);
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+    const QString &errorString() const { return errorText; }
+
+    static const double measureSeconds;
+    static const float maxPassingLoad;      // p99 load at or below this passes
+
+private:
+    int initializeRTcmix(int bufferSize);
+    int memberCallback(void *output, unsigned long frameCount, PaStreamCallbackFlags statusFlags);
+    static int paCallback(const void *input, void *output, unsigned long frameCount,
+                          const PaStreamCallbackTimeInfo *timeInfo, PaStreamCallbackFlags statusFlags, void *userData)
+    {
+        (void) input;
+        (void) timeInfo;
+        return reinterpret_cast<BufferTuner *>(userData)->memberCallback(output, frameCount, statusFlags);
+    }
+
+    PaDeviceIndex outputDeviceID;
+    float samplingRate;
+    int numOutChannels;
+    int busCount;
+    int latencyProfile;
+    std::atomic<bool> cancelled;
+    QString errorText;
+
+    // Written by the callback, read after the stream stops (or, for the
+    // load, by the measuring thread while it runs).
+    std::atomic<bool> measuring;    // false while the stream settles
+    double period;                  // seconds
+    DspLoadMeter *dspLoad;
+    std::chrono::steady_clock::time_point lastCallback;
+    bool haveLastCallback;
+    int underflows;
+    long intervals;
+    double jitterSum;
+    double maxJitter;
+};
+
+class BufferTunerWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    BufferTunerWorker(BufferTuner *tuner, const QVector<int> &sizes) : tuner(tuner), sizes(sizes) {}
+
+public slots:
+    void tune();
+
+signals:
+    void progress(int sizeIndex, int bufferSize);
+    void measured(const QString &report);
+    void finished(int bestSize);
+
+private:
+    BufferTuner *tuner;
+    QVector<int> sizes;
+};
+
+class BufferTunerThreadController : public QObject
+{
+    Q_OBJECT
+
+    QThread workerThread;
+
+public:
+    BufferTunerThreadController(BufferTuner *tuner, const QVector<int> &sizes) {
+        BufferTunerWorker *worker = new BufferTunerWorker(tuner, sizes);
+        worker->moveToThread(&workerThread);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &BufferTunerWorker::tune);
+        CHECKED_CONNECT(worker, &BufferTunerWorker::progress, this, &BufferTunerThreadController::progress);
+        CHECKED_CONNECT(worker, &BufferTunerWorker::measured, this, &BufferTunerThreadController::measured);
+        CHECKED_CONNECT(worker, &BufferTunerWorker::finished, this, &BufferTunerThreadController::finished);
+    }
+    ~BufferTunerThreadController() {
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start() { workerThread.start(); }
+
+signals:
+    void progress(int sizeIndex, int bufferSize);
+    void measured(const QString &report);
+    void finished(int bestSize);
+};
+
+#endif // BUFFERTUNER_H
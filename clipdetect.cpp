@@ -0,0 +1,115 @@
+#include <math.h>
+#include "clipdetect.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CLIPDETECT_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define CLIPDETECT_NEON
+#endif
+
+// The smallest float greater than 0.999 (as a double) is 0.999f, so this
+// matches the old test, fabs(samp) > 0.999.
+const float fullScale = 0.999f;
+
+// Is any of these <count> samples at full scale? <count> is a multiple of 4.
+static inline bool anyFullScale(const float *samps, int count)
+{
+#if defined(CLIPDETECT_SSE2)
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 threshold = _mm_set1_ps(fullScale);
+    __m128 hits = _mm_setzero_ps();
+    for (int i = 0; i < count; i += 4) {
+        const __m128 mag = _mm_andnot_ps(signMask, _mm_loadu_ps(samps + i));
+        hits = _mm_or_ps(hits, _mm_cmpge_ps(mag, threshold));
+    }
+    return _mm_movemask_ps(hits) != 0;
+#elif defined(CLIPDETECT_NEON)
+    const float32x4_t threshold = vdupq_n_f32(fullScale);
+    uint32x4_t hits = vdupq_n_u32(0);
+    for (int i = 0; i < count; i += 4)
+        hits = vorrq_u32(hits, vcgeq_f32(vabsq_f32(vld1q_f32(samps + i)), threshold));
+    return vmaxvq_u32(hits) != 0;
+#else
+    for (int i = 0; i < count; i++) {
+        if (fabsf(samps[i]) >= fullScale)
+            return true;
+    }
+    return false;
+#endif
+}
+
+// The exact run-length count, one sample at a time.
+template <int Chans>
+static inline void countRuns(const float *samps, long numFrames, int numChans, int *runs, std::atomic<int> *clipCounts)
+{
+    const int chans = Chans ? Chans : numChans;
+    for (long f = 0; f < numFrames; f++) {
+        for (int c = 0; c < chans; c++) {
+            if (fabsf(*samps++) >= fullScale)
+                runs[c]++;
+            else {
+                if (runs[c] > consecutiveFullScaleSamps)
+                    clipCounts[c]++;
+                runs[c] = 0;
+            }
+        }
+    }
+}
+
+// What countRuns would do with a chunk that has no full-scale samples.
+static inline void endRuns(int numChans, int *runs, std::atomic<int> *clipCounts)
+{
+    for (int c = 0; c < numChans; c++) {
+        if (runs[c] > consecutiveFullScaleSamps)
+            clipCounts[c]++;
+        runs[c] = 0;
+    }
+}
+
+// Chans == 0 means any channel count, given by <numChans>.
+template <int Chans>
+static void detectClipping(const float *samps, unsigned long frameCount, int numChans, int *runs, std::atomic<int> *clipCounts)
+{
+    const int chans = Chans ? Chans : numChans;
+    // 16 samples per chunk for the fixed channel counts; 4 frames otherwise.
+    const long chunkFrames = Chans ? 16 / Chans : 4;
+    const int chunkSamps = int(chunkFrames) * chans;
+    const long numFrames = long(frameCount);
+
+    bool runsOpen = false;
+    for (int c = 0; c < chans; c++) {
+        if (runs[c])
+            runsOpen = true;
+    }
+    long f = 0;
+    for (; f + chunkFrames <= numFrames; f += chunkFrames) {
+        const float *chunk = samps + f * chans;
+        if (anyFullScale(chunk, chunkSamps)) {
+            countRuns<Chans>(chunk, chunkFrames, chans, runs, clipCounts);
+            runsOpen = true;
+        }
+        else if (runsOpen) {
+            endRuns(chans, runs, clipCounts);
+            runsOpen = false;
+        }
+    }
+    countRuns<Chans>(samps + f * chans, numFrames - f, chans, runs, clipCounts);
+}
+
+ClipDetectFunction clipDetectFunctionForChannels(int numChans)
+{
+    switch (numChans) {
+    case 1:
+        return detectClipping<1>;
+    case 2:
+        return detectClipping<2>;
+    case 4:
+        return detectClipping<4>;
+    case 8:
+        return detectClipping<8>;
+    default:
+        return detectClipping<0>;
+    }
+}
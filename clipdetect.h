@@ -0,0 +1,26 @@
+#ifndef CLIPDETECT_H
+#define CLIPDETECT_H
+
+#include <atomic>
+
+// Clip detection for the audio callback. A run of more than
+// consecutiveFullScaleSamps full-scale samples (|samp| > 0.999) in a channel
+// counts as one clip for that channel. This is (over-) simple: it also fires
+// for a signal that oscillates between -1 and +1.
+//
+// <runs> holds the length of the current full-scale run in each channel, and
+// carries over from one callback to the next. Most buffers have no full-scale
+// samples at all, so the kernels check a whole chunk of samples at once with
+// SIMD compares, and only walk a chunk sample by sample when something in it
+// is at full scale. There are versions for 1, 2, 4 and 8 channels, with the
+// channel count fixed at compile time, and a general one for other counts.
+
+const int consecutiveFullScaleSamps = 2;
+
+typedef void (*ClipDetectFunction)(const float *samps, unsigned long frameCount, int numChans,
+                                   int *runs, std::atomic<int> *clipCounts);
+
+// Pick the kernel for a stream with this many channels.
+ClipDetectFunction clipDetectFunctionForChannels(int numChans);
+
+#endif // CLIPDETECT_H
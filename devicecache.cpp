@@ -0,0 +1,145 @@
+#include <string.h>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QSettings>
+#include <QStringList>
+#include "devicecache.h"
+
+QRecursiveMutex portAudioMutex;
+
+// "ALSA/hw:0,0 (USB Audio)/2", percent-encoded so that names can't make groups.
+static QString deviceKey(PaDeviceIndex deviceID, int numChans)
+{
+    QMutexLocker locker(&portAudioMutex);
+    const PaDeviceInfo *deviceInfo = Pa_GetDeviceInfo(deviceID);
+    if (deviceInfo == NULL)
+        return QString();
+    const PaHostApiInfo *apiInfo = Pa_GetHostApiInfo(deviceInfo->hostApi);
+    const QByteArray api = apiInfo ? QByteArray(apiInfo->name) : QByteArray();
+    return QString("deviceCache/rates/%1|%2|%3")
+            .arg(QString::fromLatin1(api.toPercentEncoding()))
+            .arg(QString::fromLatin1(QByteArray(deviceInfo->name).toPercentEncoding()))
+            .arg(numChans);
+}
+
+bool cachedSamplingRates(PaDeviceIndex deviceID, int numChans, QVector<int> &rates)
+{
+    const QString key = deviceKey(deviceID, numChans);
+    if (key.isEmpty())
+        return false;
+    QSettings settings;
+    const QVariant value = settings.value(key);
+    if (!value.isValid())
+        return false;
+    const QStringList list = value.toString().split(',', Qt::SkipEmptyParts);
+    for (const QString &rate : list)
+        rates.append(rate.toInt());
+    return !rates.isEmpty();
+}
+
+void cacheSamplingRates(PaDeviceIndex deviceID, int numChans, const QVector<int> &rates)
+{
+    // An empty list usually means the device was busy, not that it can't do
+    // anything, so don't remember it.
+    const QString key = deviceKey(deviceID, numChans);
+    if (key.isEmpty() || rates.isEmpty())
+        return;
+    QStringList list;
+    for (int rate : rates)
+        list.append(QString::number(rate));
+    QSettings settings;
+    settings.setValue(key, list.join(','));
+}
+
+int probeSamplingRates(PaDeviceIndex deviceID, int numChans, QVector<int> &rates)
+{
+    PaStreamParameters outParams;
+    memset(&outParams, 0, sizeof(outParams));
+    outParams.channelCount = numChans;
+    outParams.device = deviceID;
+    outParams.sampleFormat = paFloat32;
+
+    static int standardSamplingRates[] = { 44100, 48000, 88200, 96000, 176400, 192000, -1 };
+    int count = 0;
+    for (int i = 0; standardSamplingRates[i] > 0; i++) {
+        // Each call can take a while, so let the GUI thread in between them.
+        portAudioMutex.lock();
+        PaError err = Pa_IsFormatSupported(NULL, &outParams, standardSamplingRates[i]);
+        portAudioMutex.unlock();
+        if (err == paFormatIsSupported) {
+            rates.append(standardSamplingRates[i]);
+            count++;
+        }   // we don't report an err, because the point is to exclude invalid rates silently
+    }
+    return count;
+}
+
+// A fingerprint of every host API and device, with its channel counts.
+static QString deviceListSignature()
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    QMutexLocker locker(&portAudioMutex);
+    const PaDeviceIndex numDevices = Pa_GetDeviceCount();
+    for (PaDeviceIndex i = 0; i < numDevices; i++) {
+        const PaDeviceInfo *info = Pa_GetDeviceInfo(i);
+        if (info == NULL)
+            continue;
+        const PaHostApiInfo *apiInfo = Pa_GetHostApiInfo(info->hostApi);
+        if (apiInfo)
+            hash.addData(QByteArray(apiInfo->name));
+        hash.addData(QByteArray(info->name));
+        hash.addData(QByteArray::number(info->maxInputChannels) + ',' + QByteArray::number(info->maxOutputChannels) + '\n');
+    }
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+bool validateDeviceCache()
+{
+    const QString signature = deviceListSignature();
+    QSettings settings;
+    if (settings.value("deviceCache/signature").toString() == signature)
+        return false;
+    settings.remove("deviceCache");
+    settings.setValue("deviceCache/signature", signature);
+    return true;
+}
+
+
+// --------------------------------------------------------------------------
+
+// Fill in whatever the cache is missing, for every output device.
+void DeviceProbeWorker::probe()
+{
+    // This uses Audio's PortAudio session rather than holding a reference of
+    // its own, which would keep PortAudio from rescanning the devices when
+    // Audio re-initializes it. MainWindow stops us before it replaces Audio.
+    // The lock is only held a call at a time, so the GUI thread never waits
+    // long for it.
+    int devicesProbed = 0;
+    portAudioMutex.lock();
+    const PaDeviceIndex numDevices = Pa_GetDeviceCount();
+    portAudioMutex.unlock();
+    for (PaDeviceIndex id = 0; id < numDevices && keepProbing; id++) {
+        QMutexLocker locker(&portAudioMutex);
+        const PaDeviceInfo *info = Pa_GetDeviceInfo(id);
+        if (info == NULL || info->maxOutputChannels <= 0 || id == skipDeviceID)
+            continue;
+        const int maxOutputChannels = info->maxOutputChannels;
+        locker.unlock();
+        bool probed = false;
+        for (int i = 0; i < channelCounts.size() && keepProbing; i++) {
+            const int numChans = channelCounts[i];
+            if (numChans > maxOutputChannels)
+                continue;
+            QVector<int> rates;
+            if (cachedSamplingRates(id, numChans, rates))
+                continue;
+            probeSamplingRates(id, numChans, rates);
+            cacheSamplingRates(id, numChans, rates);
+            probed = true;
+        }
+        if (probed)
+            devicesProbed++;
+    }
+    emit finished(devicesProbed);
+}
@@ -0,0 +1,87 @@
+#ifndef DEVICECACHE_H
+#define DEVICECACHE_H
+
+#include <atomic>
+#include <QObject>
+#include <QRecursiveMutex>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include "portaudio.h"
+#include "utils.h"
+
+// What each audio device supports, remembered across runs. Finding out means
+// calling Pa_IsFormatSupported for every sampling rate, which on some hosts
+// (ALSA with many devices, especially) takes seconds -- far too long for the
+// GUI thread to spend every time the preferences dialog opens. So we ask once,
+// on a background thread, and store the answers in the settings file under
+// "deviceCache", keyed by host API, device name and channel count. Device
+// numbers aren't stable across runs, but those are.
+//
+// The whole cache is thrown out when the device list changes.
+
+// PortAudio isn't thread-safe, and the probe thread uses it alongside the GUI
+// thread. Hold this around every call that initializes or terminates it,
+// enumerates devices, or opens, closes or tests a stream, on any thread.
+// It's recursive, so helpers that take it can be called with it held.
+extern QRecursiveMutex portAudioMutex;
+
+// Both return false for a combination we haven't probed yet.
+bool cachedSamplingRates(PaDeviceIndex, int numChans, QVector<int> &rates);
+void cacheSamplingRates(PaDeviceIndex, int numChans, const QVector<int> &rates);
+
+// Ask the device. Takes portAudioMutex around each rate it tries.
+int probeSamplingRates(PaDeviceIndex, int numChans, QVector<int> &rates);
+
+// Clear the cache if the devices are not the ones it was made for.
+// Returns true if the cache was cleared.
+bool validateDeviceCache();
+
+class DeviceProbeWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    DeviceProbeWorker(PaDeviceIndex skipDeviceID, const QVector<int> &channelCounts)
+        : skipDeviceID(skipDeviceID), channelCounts(channelCounts), keepProbing(true) {}
+    void stop() { keepProbing = false; }
+
+public slots:
+    void probe();
+
+signals:
+    void finished(int devicesProbed);
+
+private:
+    PaDeviceIndex skipDeviceID;     // the one we have open, which may refuse to be probed
+    QVector<int> channelCounts;
+    std::atomic<bool> keepProbing;
+};
+
+class DeviceProbeThreadController : public QObject
+{
+    Q_OBJECT
+
+    QThread workerThread;
+    DeviceProbeWorker *worker;
+
+public:
+    DeviceProbeThreadController(PaDeviceIndex skipDeviceID, const QVector<int> &channelCounts) {
+        worker = new DeviceProbeWorker(skipDeviceID, channelCounts);
+        worker->moveToThread(&workerThread);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &DeviceProbeWorker::probe);
+        CHECKED_CONNECT(worker, &DeviceProbeWorker::finished, this, &DeviceProbeThreadController::finished);
+    }
+    ~DeviceProbeThreadController() {
+        worker->stop();
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start() { workerThread.start(QThread::LowPriority); }
+
+signals:
+    void finished(int devicesProbed);
+};
+
+#endif // DEVICECACHE_H
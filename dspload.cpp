@@ -0,0 +1,81 @@
+#include <limits.h>
+#include "dspload.h"
+
+DspLoadMeter::DspLoadMeter()
+{
+    for (int i = 0; i < numBins; i++)
+        bins[i] = 0;
+    permilleSum = 0;
+    reset();
+}
+
+void DspLoadMeter::add(double load)
+{
+    const int permille = (load < INT_MAX / 1000.0) ? int(load * 1000.0 + 0.5) : INT_MAX;
+    const int bin = (permille / 10 < numBins) ? permille / 10 : numBins - 1;
+    // The increments are atomic, so it doesn't matter which thread adds (the
+    // callback, or the render-ahead thread in that mode), and nothing else
+    // depends on their order, so relaxed is enough. read() can see a count
+    // and the sum a callback apart, which the display won't show.
+    bins[bin].fetch_add(1, std::memory_order_relaxed);
+    permilleSum.fetch_add(permille, std::memory_order_relaxed);
+
+    // read() resets min and max, so these need a CAS rather than a plain store.
+    int old = minPermille.load(std::memory_order_relaxed);
+    while (permille < old && !minPermille.compare_exchange_weak(old, permille, std::memory_order_relaxed))
+        ;
+    old = maxPermille.load(std::memory_order_relaxed);
+    while (permille > old && !maxPermille.compare_exchange_weak(old, permille, std::memory_order_relaxed))
+        ;
+}
+
+// Summarize the callbacks since the last read. The counters only ever grow,
+// so the interval's histogram is the difference from the copy we kept.
+DspLoadMeter::Stats DspLoadMeter::read()
+{
+    unsigned int counts[numBins];
+    unsigned int total = 0;
+    for (int i = 0; i < numBins; i++) {
+        const unsigned int now = bins[i].load(std::memory_order_relaxed);
+        counts[i] = now - lastBins[i];      // wraps correctly
+        lastBins[i] = now;
+        total += counts[i];
+    }
+    const unsigned long long sum = permilleSum.load(std::memory_order_relaxed);
+    const unsigned long long intervalSum = sum - lastPermilleSum;
+    lastPermilleSum = sum;
+    const int minNow = minPermille.exchange(INT_MAX, std::memory_order_relaxed);
+    const int maxNow = maxPermille.exchange(0, std::memory_order_relaxed);
+
+    Stats stats = {};
+    stats.callbacks = int(total);
+    if (total > 0) {
+        // p99: the top of the first bin at which 99% of the callbacks are counted.
+        const unsigned int target = total - total / 100;
+        unsigned int count = 0;
+        int bin = 0;
+        while (bin < numBins - 1 && (count += counts[bin]) < target)
+            bin++;
+        if (maxNow > sessionMaxPermille)
+            sessionMaxPermille = maxNow;
+        stats.min = (minNow == INT_MAX) ? 0.0f : minNow / 1000.0f;
+        stats.max = maxNow / 1000.0f;
+        stats.avg = float(double(intervalSum) / total / 1000.0);
+        stats.p99 = (bin + 1) / 100.0f;
+        if (stats.p99 > stats.max)
+            stats.p99 = stats.max;
+    }
+    stats.sessionMax = sessionMaxPermille / 1000.0f;
+    return stats;
+}
+
+// GUI thread only, though a callback can be running.
+void DspLoadMeter::reset()
+{
+    for (int i = 0; i < numBins; i++)
+        lastBins[i] = bins[i].load(std::memory_order_relaxed);
+    lastPermilleSum = permilleSum.load(std::memory_order_relaxed);
+    minPermille = INT_MAX;
+    maxPermille = 0;
+    sessionMaxPermille = 0;
+}
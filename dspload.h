@@ -0,0 +1,49 @@
+#ifndef DSPLOAD_H
+#define DSPLOAD_H
+
+#include <atomic>
+
+// How much of each buffer period the audio callback spends in RTcmix, as a
+// fraction: 1.0 means the score took exactly as long to compute as the buffer
+// takes to play, and anything above that is a dropout. The callback adds each
+// measurement to a histogram of atomic counters; the GUI thread reads the
+// counters at its own pace and summarizes what arrived since its last read.
+// Neither side locks or waits.
+
+class DspLoadMeter
+{
+public:
+    struct Stats {
+        int callbacks;          // in this interval; the rest is meaningless if 0
+        float min;
+        float avg;
+        float p99;
+        float max;
+        float sessionMax;       // since reset()
+    };
+
+    DspLoadMeter();
+
+    // Whichever thread runs RTcmix: the audio callback, or the render-ahead
+    // thread in that mode.
+    void add(double load);
+
+    // GUI thread only.
+    Stats read();
+    void reset();
+
+    static const int numBins = 256;         // percent of the period, the last bin for 255% and up
+
+private:
+    std::atomic<unsigned int> bins[numBins];
+    std::atomic<unsigned long long> permilleSum;
+    std::atomic<int> minPermille;           // since the last read
+    std::atomic<int> maxPermille;
+
+    // GUI only
+    unsigned int lastBins[numBins];
+    unsigned long long lastPermilleSum;
+    int sessionMaxPermille;
+};
+
+#endif // DSPLOAD_H
@@ -0,0 +1,108 @@
+#ifndef LEVELMETER_H
+#define LEVELMETER_H
+
+#include <QWidget>
+#include <QPainter>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <QtMath>
+
+// A small per-channel level meter for the toolbar, next to the clipping Led.
+// One thin horizontal bar per channel, on a dB scale: RMS in green, peak in a
+// lighter green beyond it, and a peak-hold tick that turns red at full scale.
+// A red mark at the right end of a bar means the channel's true peak has gone
+// over 0 dBTP since playing started; the tooltip gives the max in dBTP.
+// Audio feeds it at display rate (see Audio::checkMeters).
+class LevelMeter : public QWidget {
+    Q_OBJECT
+    LevelMeter(const LevelMeter&) = delete;
+    LevelMeter& operator = (const LevelMeter&) = delete;
+
+public:
+    explicit LevelMeter(QWidget* parent = nullptr)
+        : QWidget(parent)
+    {
+    }
+
+    QSize sizeHint() const override {
+        return QSize(96, 16);
+    }
+
+public slots:
+    void setLevels(const QVector<float> &peak, const QVector<float> &rms, const QVector<float> &peakHold)
+    {
+        m_peak = peak;
+        m_rms = rms;
+        m_peakHold = peakHold;
+        update();
+    }
+
+    void setTruePeaks(const QVector<float> &maxTruePeak)
+    {
+        m_truePeak = maxTruePeak;
+        QString tip = tr("Output levels (RMS, peak and peak hold, per channel)");
+        if (!maxTruePeak.isEmpty()) {
+            tip += QLatin1Char('\n') + tr("Max true peak:");
+            for (int c = 0; c < maxTruePeak.size(); c++) {
+                const QString level = (maxTruePeak[c] > 0.0f)
+                        ? QString::number(20.0 * log10(maxTruePeak[c]), 'f', 1) + tr(" dBTP")
+                        : tr("-inf");
+                tip += QLatin1Char('\n') + QString(tr("  chan %1: %2")).arg(c + 1).arg(level);
+            }
+        }
+        setToolTip(tip);
+        update();
+    }
+
+protected:
+    virtual void paintEvent(QPaintEvent *event) override
+    {
+        Q_UNUSED(event)
+        QPainter painter(this);
+        const QRect frame = QRect(0, 0, width() - 1, 13);
+        painter.setPen(Qt::darkGray);
+        painter.setBrush(Qt::NoBrush);
+        painter.drawRect(frame);
+
+        const int numChans = m_peak.size();
+        if (numChans == 0)
+            return;
+        const QRect inside = frame.adjusted(1, 1, 0, 0);
+        const int barHeight = qMax(1, inside.height() / numChans);
+        for (int c = 0; c < numChans && c * barHeight < inside.height(); c++) {
+            const int y = inside.top() + c * barHeight;
+            const int rmsX = xForLevel(m_rms[c], inside.width());
+            const int peakX = xForLevel(m_peak[c], inside.width());
+            const int holdX = xForLevel(m_peakHold[c], inside.width());
+            painter.fillRect(inside.left(), y, rmsX, barHeight, QColor(0, 160, 0));
+            if (peakX > rmsX)
+                painter.fillRect(inside.left() + rmsX, y, peakX - rmsX, barHeight, QColor(120, 210, 120));
+            if (holdX > 0) {
+                const QColor holdColor = (m_peakHold[c] >= 1.0f) ? Qt::red : Qt::darkGreen;
+                painter.fillRect(inside.left() + holdX - 1, y, 2, barHeight, holdColor);
+            }
+            if (c < m_truePeak.size() && m_truePeak[c] > 1.0f)
+                painter.fillRect(inside.right() - 2, y, 3, barHeight, Qt::red);
+        }
+    }
+
+private:
+    // -60 dBFS at the left edge to 0 dBFS at the right.
+    static int xForLevel(float amp, int width)
+    {
+        const float minDB = -60.0f;
+        if (amp <= 0.0f)
+            return 0;
+        const float dB = 20.0f * log10f(amp);
+        const float frac = qBound(0.0f, (dB - minDB) / -minDB, 1.0f);
+        return int(frac * width + 0.5f);
+    }
+
+    QVector<float> m_peak;
+    QVector<float> m_rms;
+    QVector<float> m_peakHold;
+    QVector<float> m_truePeak;
+};
+
+#endif // LEVELMETER_H
@@ -49,31 +49,231 @@
 ****************************************************************************/
 
 #include "audio.h"
+#include "batchrender.h"
 #include "mainwindow.h"
 #include "myapp.h"
+#include "record.h"
+#include "render.h"
+#include "RTcmix_API.h"
 
+#include <limits.h>
+#include <stdio.h>
 #include <QCommandLineParser>
 #include <QCommandLineOption>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
 
 #define APP_ORGANIZATION_NAME       "RTcmix"
 #define APP_ORGANIZATION_DOMAIN     "rtcmix.org"
 #define APP_NAME                    "RTcmixShell"
 #define APP_VERSION_STR             "1.1.1"
 
-int main(int argc, char *argv[])
-{
-    Q_INIT_RESOURCE(RTcmixShell);
+// Exit codes for headless rendering
+enum {
+    renderExitOK = 0,
+    renderExitUsage = 1,
+    renderExitParseError = 2,
+    renderExitRenderError = 3
+};
 
-    MyApplication theApp(argc, argv);
+static void setApplicationInfo()
+{
     QCoreApplication::setOrganizationName(APP_ORGANIZATION_NAME);
     QCoreApplication::setOrganizationDomain(APP_ORGANIZATION_DOMAIN);
     QCoreApplication::setApplicationName(APP_NAME);
     QCoreApplication::setApplicationVersion(APP_VERSION_STR);
-    QCommandLineParser parser;
+}
+
+static void addCommandLineOptions(QCommandLineParser &parser)
+{
     parser.setApplicationDescription(QCoreApplication::applicationName());
     parser.addHelpOption();
     parser.addVersionOption();
     parser.addPositionalArgument("file", "The file to open.");
+    parser.addOption(QCommandLineOption("render", "Render <score> to a sound file without opening a window or an audio device.", "score"));
+    parser.addOption(QCommandLineOption(QStringList() << "o" << "output", "Write the rendered sound to <file> (.wav, .aif, .aiff, .flac or .ogg).", "file"));
+    parser.addOption(QCommandLineOption("srate", "Sampling rate for rendering (default: 44100).", "rate", "44100"));
+    parser.addOption(QCommandLineOption("chans", "Number of output channels for rendering (default: 2).", "count", "2"));
+    parser.addOption(QCommandLineOption("bufsize", "RTcmix buffer size for rendering (default: 512).", "frames", "512"));
+    parser.addOption(QCommandLineOption("buses", "Number of RTcmix buses for rendering (default: 32).", "count", "32"));
+    parser.addOption(QCommandLineOption("bits", "Sample format of the rendered file: 32 (float), 24 or 16 (default: 32).", "bits", "32"));
+    parser.addOption(QCommandLineOption("batch", "Render every score named by <path> (a directory of .sco files, or a file listing one score per line) into the directory given by -o.", "path"));
+    parser.addOption(QCommandLineOption("jobs", "Number of worker processes for --batch (default: number of cores).", "count", QString::number(QThread::idealThreadCount())));
+    parser.addOption(QCommandLineOption("timeout", "Kill any --batch job that runs longer than <seconds> (default: no limit).", "seconds", "0"));
+    parser.addOption(QCommandLineOption("format", "Sound file type for --batch output: wav, aif, aiff, flac or ogg (default: wav).", "ext", "wav"));
+}
+
+// QApplication needs a display, so we have to decide whether we're rendering
+// headless before constructing the application object.
+static bool wantsHeadlessRender(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (qstrcmp(argv[i], "--render") == 0 || qstrncmp(argv[i], "--render=", 9) == 0)
+            return true;
+        if (qstrcmp(argv[i], "--batch") == 0 || qstrncmp(argv[i], "--batch=", 8) == 0)
+            return true;
+    }
+    return false;
+}
+
+// RTcmix messages go to stderr, so that stdout holds only the timing summary.
+// See rtcmixPrintCallback() in rtcmixlogview.cpp for the buffer layout.
+static void headlessPrintCallback(const char *printBuffer, void *inContext)
+{
+    (void) inContext;
+    const char *p = printBuffer;
+    if (p[0] == 0) {
+        if (p[1] == 0)
+            return;
+        p++;
+    }
+    while (*p) {
+        fputs(p, stderr);
+        p += strlen(p) + 1;
+    }
+}
+
+static int intOption(const QCommandLineParser &parser, const QString &name, int minVal, int maxVal, bool &ok)
+{
+    int val = parser.value(name).toInt(&ok);
+    if (!ok || val < minVal || val > maxVal) {
+        fprintf(stderr, "%s: invalid value for --%s: \"%s\"\n", APP_NAME, qPrintable(name), qPrintable(parser.value(name)));
+        ok = false;
+    }
+    return val;
+}
+
+static int bitDepthOption(const QCommandLineParser &parser, bool &ok)
+{
+    int val = parser.value("bits").toInt(&ok);
+    if (!ok || (val != recordBitDepthFloat && val != recordBitDepth24 && val != recordBitDepth16)) {
+        fprintf(stderr, "%s: invalid value for --bits: \"%s\"\n", APP_NAME, qPrintable(parser.value("bits")));
+        ok = false;
+    }
+    return val;
+}
+
+static int headlessRender(const QCommandLineParser &parser)
+{
+    const QString scoreName = parser.value("render");
+    const QString outName = parser.value("output");
+    if (outName.isEmpty()) {
+        fprintf(stderr, "%s: --render requires an output file (-o <file>)\n", APP_NAME);
+        return renderExitUsage;
+    }
+
+    bool ok1, ok2, ok3, ok4, ok5;
+    const int samplingRate = intOption(parser, "srate", 8000, 768000, ok1);
+    const int numChans = intOption(parser, "chans", 1, 64, ok2);
+    const int bufferSize = intOption(parser, "bufsize", 16, 65536, ok3);
+    const int busCount = intOption(parser, "buses", 1, 1024, ok4);
+    const int bitDepth = bitDepthOption(parser, ok5);
+    if (!(ok1 && ok2 && ok3 && ok4 && ok5))
+        return renderExitUsage;
+
+    QFile file(scoreName);
+    if (!file.open(QFile::ReadOnly)) {
+        fprintf(stderr, "%s: could not open score \"%s\": %s\n", APP_NAME, qPrintable(scoreName), qPrintable(file.errorString()));
+        return renderExitUsage;
+    }
+    const QByteArray score = file.readAll();
+
+    RTcmix_setPrintCallback(headlessPrintCallback, NULL);
+
+    OfflineRenderer renderer(samplingRate, numChans, bufferSize, busCount, bitDepth);
+    OfflineRenderer::Status status = renderer.render(score, outName);
+
+    QJsonObject summary;
+    summary["score"] = scoreName;
+    summary["output"] = outName;
+    summary["status"] = (status == OfflineRenderer::RenderOK) ? "ok"
+                      : (status == OfflineRenderer::RenderParseError) ? "parse-error" : "render-error";
+    summary["frames"] = double(renderer.framesRendered());
+    summary["seconds"] = renderer.scoreSeconds();
+    summary["elapsed"] = renderer.elapsedSeconds();
+    summary["realtime"] = renderer.realtimeFactor();
+    if (status != OfflineRenderer::RenderOK) {
+        summary["error"] = renderer.errorString();
+        fprintf(stderr, "%s: %s\n", APP_NAME, qPrintable(renderer.errorString()));
+    }
+    fprintf(stdout, "%s\n", QJsonDocument(summary).toJson(QJsonDocument::Compact).constData());
+    fflush(stdout);
+
+    if (status == OfflineRenderer::RenderOK)
+        return renderExitOK;
+    return (status == OfflineRenderer::RenderParseError) ? renderExitParseError : renderExitRenderError;
+}
+
+// Farm out a list of scores to worker processes that each run headlessRender().
+static int headlessBatchRender(QCoreApplication &app, const QCommandLineParser &parser)
+{
+    const QString outDir = parser.value("output");
+    if (outDir.isEmpty()) {
+        fprintf(stderr, "%s: --batch requires an output directory (-o <dir>)\n", APP_NAME);
+        return renderExitUsage;
+    }
+    const QString ext = parser.value("format");
+    if (!(QStringList() << "wav" << "aif" << "aiff" << "flac" << "ogg").contains(ext)) {
+        fprintf(stderr, "%s: invalid value for --format: \"%s\"\n", APP_NAME, qPrintable(ext));
+        return renderExitUsage;
+    }
+
+    bool ok1, ok2, ok3, ok4, ok5, ok6, ok7;
+    const int samplingRate = intOption(parser, "srate", 8000, 768000, ok1);
+    const int numChans = intOption(parser, "chans", 1, 64, ok2);
+    const int bufferSize = intOption(parser, "bufsize", 16, 65536, ok3);
+    const int busCount = intOption(parser, "buses", 1, 1024, ok4);
+    const int numWorkers = intOption(parser, "jobs", 1, 1024, ok5);
+    const int timeoutSecs = intOption(parser, "timeout", 0, INT_MAX / 1000, ok6);
+    const int bitDepth = bitDepthOption(parser, ok7);
+    if (!(ok1 && ok2 && ok3 && ok4 && ok5 && ok6 && ok7))
+        return renderExitUsage;
+
+    QStringList scores;
+    const QString batchPath = parser.value("batch");
+    if (collectBatchScores(batchPath, scores) <= 0) {
+        fprintf(stderr, "%s: no scores found in \"%s\"\n", APP_NAME, qPrintable(batchPath));
+        return renderExitUsage;
+    }
+    if (!QDir().mkpath(outDir)) {
+        fprintf(stderr, "%s: could not create output directory \"%s\"\n", APP_NAME, qPrintable(outDir));
+        return renderExitUsage;
+    }
+
+    QStringList renderArgs;
+    renderArgs << "--srate" << QString::number(samplingRate)
+               << "--chans" << QString::number(numChans)
+               << "--bufsize" << QString::number(bufferSize)
+               << "--buses" << QString::number(busCount)
+               << "--bits" << QString::number(bitDepth);
+    BatchRenderer batch(scores, outDir, ext, renderArgs, numWorkers, timeoutSecs);
+    batch.start();
+    return app.exec();
+}
+
+int main(int argc, char *argv[])
+{
+    if (wantsHeadlessRender(argc, argv)) {
+        QCoreApplication app(argc, argv);
+        setApplicationInfo();
+        QCommandLineParser parser;
+        addCommandLineOptions(parser);
+        parser.process(app);
+        if (parser.isSet("batch"))
+            return headlessBatchRender(app, parser);
+        return headlessRender(parser);
+    }
+
+    Q_INIT_RESOURCE(RTcmixShell);
+
+    MyApplication theApp(argc, argv);
+    setApplicationInfo();
+    QCommandLineParser parser;
+    addCommandLineOptions(parser);
     parser.process(theApp);
 
     MainWindow mw;
@@ -3,11 +3,15 @@
 #include <QtDebug>
 
 #include "audio.h"
+#include "buffertuner.h"
+#include "devicecache.h"
 #include "finddialog.h"
 #include "led.h"
+#include "levelmeter.h"
 #include "mainwindow.h"
 #include "rtcmixlogview.h"
 #include "preferences.h"
+#include "render.h"
 #include "RTcmix_API.h"
 #include "utils.h"
 #include "credits.h"
@@ -25,8 +29,15 @@ void rtcmixFinishedCallback(long long frameCount, void *inContext);
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
+    , renderer(NULL)
+    , renderThreadController(NULL)
+    , bufferTuner(NULL)
+    , bufferTunerThreadController(NULL)
+    , bufferTunerDialog(NULL)
+    , deviceProbeThreadController(NULL)
     , playing(false)
     , recording(false)
+    , rendering(false)
     , reinitRTcmixOnPlay(false)
     , firstFileDialog(true)
 {
@@ -52,6 +63,7 @@ MainWindow::MainWindow(QWidget *parent)
     createActions();
     createMenus();
     createToolbars();
+    createStatusBar();
 
     initFonts();
 
@@ -60,6 +72,8 @@ MainWindow::MainWindow(QWidget *parent)
     CHECKED_CONNECT(scoreFinishedTimer, &QTimer::timeout, this, &MainWindow::checkScoreFinished);
     setScorePlayMode(); // defaults to Exclusive, because menu action initially unchecked
 
+    startDeviceProbe();
+
     curEditor->setFocus();
 }
 
@@ -224,6 +238,21 @@ void MainWindow::createScoreActions()
     actionRecord->setStatusTip(tr("Record the sound that's playing to a sound file"));
     CHECKED_CONNECT(actionRecord, &QAction::triggered, this, &MainWindow::record);
 
+    actionRender = new QAction(tr("Render to &File..."), this);
+    actionRender->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_R);
+    actionRender->setStatusTip(tr("Render the score to a sound file as fast as possible, without playing it"));
+    CHECKED_CONNECT(actionRender, &QAction::triggered, this, &MainWindow::renderToFile);
+
+    actionSaveHistory = new QAction(this);
+    actionSaveHistory->setShortcut(Qt::CTRL | Qt::ALT | Qt::Key_R);
+    actionSaveHistory->setStatusTip(tr("Save the sound that just played to a sound file, as if you had been recording"));
+    CHECKED_CONNECT(actionSaveHistory, &QAction::triggered, this, &MainWindow::saveHistory);
+
+    actionFindBufferSize = new QAction(tr("Find &Best Buffer Size..."), this);
+    actionFindBufferSize->setStatusTip(tr("Try the audio device at each buffer size, and suggest the smallest that plays reliably"));
+    CHECKED_CONNECT(actionFindBufferSize, &QAction::triggered, this, &MainWindow::findBestBufferSize);
+    updateSaveHistoryAction();
+
     actionAllowOverlappingScores = new QAction(tr("Allow Overlapping Scores"), this);
     actionAllowOverlappingScores->setStatusTip(tr("Permit one score to be played while another one is playing"));
     actionAllowOverlappingScores->setCheckable(true);
@@ -274,8 +303,11 @@ void MainWindow::createMenus()
     scoreMenu->addAction(actionPlay);
     scoreMenu->addAction(actionStop);
     scoreMenu->addAction(actionRecord);
+    scoreMenu->addAction(actionRender);
+    scoreMenu->addAction(actionSaveHistory);
     scoreMenu->addSeparator();
     scoreMenu->addAction(actionAllowOverlappingScores);
+    scoreMenu->addAction(actionFindBufferSize);
     scoreMenu->addAction(actionClearLog);
 
     QMenu *helpMenu = menuBar()->addMenu(tr("Help"));
@@ -326,6 +358,11 @@ void MainWindow::createToolbars()
     spacer->setMinimumWidth(6);
     tb->addWidget(spacer);
 
+    levelMeter = new LevelMeter(this);
+    levelMeter->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    levelMeter->setToolTip(tr("Output levels (RMS, peak and peak hold, per channel)"));
+    tb->addWidget(levelMeter);
+
     clippingIndicator = new Led(this);
     clippingIndicator->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     clippingIndicator->setToolTip(tr("Clipping indicator"));
@@ -350,6 +387,18 @@ void MainWindow::createToolbars()
 #endif
 }
 
+void MainWindow::createStatusBar()
+{
+    dspLoadLabel = new QLabel(tr("DSP: --"), this);
+    dspLoadLabel->setToolTip(tr("Time spent computing each audio buffer, as a percentage of the time it takes to play,\n"
+                                "over the last half second. Dropouts start at 100%."));
+    statusBar()->addPermanentWidget(dspLoadLabel);
+    xrunLabel = new QLabel(tr("Dropouts: 0"), this);
+    xrunLabel->setToolTip(tr("Audio output underflows since the audio device was opened.\n"
+                             "Each one is logged with its stream and score time."));
+    statusBar()->addPermanentWidget(xrunLabel);
+}
+
 // NB: plural, in anticipation of tabbed editors
 // The member name <curEditor> because of this.
 void MainWindow::createEditors()
@@ -445,6 +494,12 @@ void MainWindow::about()
 void MainWindow::closeEvent(QCloseEvent *e)
 {
     if (maybeSave()) {
+        if (rendering) {
+            renderer->cancel();
+            delete renderThreadController;  // waits for render thread to exit
+            renderThreadController = NULL;
+        }
+        stopDeviceProbe();
         mainWindowPreferences->setMainWindowSize(size());
         mainWindowPreferences->setMainWindowPosition(pos());
         e->accept();
@@ -743,10 +798,14 @@ void MainWindow::playScore()
             stopScoreNoReinit();        // no reinit, so we can see error in log
             reinitRTcmixOnPlay = true;
         }
-		// Audio is  started up after score parsing unless we are in Overlapping mode
-		else if (scorePlayMode == Exclusive) {
-			audio->startAudio();
-		}
+        else {
+            audio->markScoreStart();
+            if (recording)
+                audio->triggerRecording();
+            // Audio is  started up after score parsing unless we are in Overlapping mode
+            if (scorePlayMode == Exclusive)
+                audio->startAudio();
+        }
     }
 //qDebug("invoked playScore(), buf len: %d, buffer...", len);
 //qDebug("%s", buf);
@@ -754,6 +813,8 @@ void MainWindow::playScore()
 
 void MainWindow::sendScoreFragment(char *fragment)
 {
+    if (rendering)      // RTcmix belongs to the render thread
+        return;
     int result = RTcmix_parseScore(fragment, int(strlen(fragment)));
     Q_UNUSED(result);
     // not sure we should stop anything in this case
@@ -776,6 +837,7 @@ void MainWindow::stopScoreNoReinit()
         actionRecord->setEnabled(true);
         recordButton->setEnabled(true);
         recording = false;
+        showRecordStats();
     }
     if (playing) {
         xableScoreActions(false);
@@ -786,6 +848,10 @@ void MainWindow::stopScoreNoReinit()
 
 void MainWindow::stopScore()
 {
+    if (rendering) {            // RTcmix belongs to the render thread until it finishes
+        renderer->cancel();
+        return;
+    }
     stopScoreNoReinit();
     rtcmixLogView->stopLog();
     setScorePrintLevel(0);
@@ -812,17 +878,80 @@ void MainWindow::showClipping(int clipCount)
     //qDebug("MainWindow::showClipping(%d)", clipCount);
 }
 
+void MainWindow::showMeterLevels(const QVector<float> &peak, const QVector<float> &rms, const QVector<float> &peakHold)
+{
+    levelMeter->setLevels(peak, rms, peakHold);
+}
+
+void MainWindow::showTruePeakLevels(const QVector<float> &maxTruePeak)
+{
+    levelMeter->setTruePeaks(maxTruePeak);
+}
+
+void MainWindow::showDspLoad(float min, float avg, float p99, float max)
+{
+    if (max < 0.0f) {
+        dspLoadLabel->setText(tr("DSP: --"));
+        return;
+    }
+    dspLoadLabel->setText(tr("DSP: avg %1%  p99 %2%  max %3%  min %4%")
+                          .arg(qRound(avg * 100.0f)).arg(qRound(p99 * 100.0f))
+                          .arg(qRound(max * 100.0f)).arg(qRound(min * 100.0f)));
+    // Red once the worst callback in the last half second came near the deadline.
+    dspLoadLabel->setStyleSheet((max >= 0.8f) ? "color: red" : "");
+}
+
+void MainWindow::showXrunCounts(int underflows, int overflows)
+{
+    QString text = tr("Dropouts: %1").arg(underflows);
+    if (overflows)
+        text += tr("  Overflows: %1").arg(overflows);
+    xrunLabel->setText(text);
+    xrunLabel->setStyleSheet(underflows ? "color: red" : "");
+}
+
+void MainWindow::showAudioMessage(const QString &msg)
+{
+    rtcmixLogView->appendPlainText(msg);
+}
+
 void MainWindow::reinitializeAudio()	// This is only called when preferences change
 {
+    // A new device or latency setting only needs the stream reopened, and
+    // the score keeps playing. Anything else means a new RTcmix.
+    if (audio->reconfigure()) {
+        updateSaveHistoryAction();
+        return;
+    }
     stopScoreNoReinit();
+    stopDeviceProbe();
     delete audio;
     audio = new Audio;
+    startDeviceProbe();
+    updateSaveHistoryAction();
+    showXrunCounts(0, 0);
     // Audio is only started up before score parsing if we are in Overlapping mode
 	if (scorePlayMode == Overlapping) {
 		audio->startAudio();
 	}
 }
 
+// Report whether the record thread kept up with the audio callback during the last take.
+void MainWindow::showRecordStats()
+{
+    const Audio::RecordStats stats = audio->recordStats();
+    const int highWaterPercent = stats.capacitySamps ? int((100.0 * stats.highWaterSamps) / stats.capacitySamps) : 0;
+    QString msg;
+    if (stats.overflows)
+        msg = QString(tr("Recording: %1 buffer overflows, %2 frames dropped (record buffer peaked at %3% of %4 sec)"))
+                .arg(stats.overflows).arg(stats.droppedFrames).arg(highWaterPercent).arg(stats.capacitySeconds, 0, 'f', 2);
+    else
+        msg = QString(tr("Recording: no overflows (record buffer peaked at %1% of %2 sec)"))
+                .arg(highWaterPercent).arg(stats.capacitySeconds, 0, 'f', 2);
+    rtcmixLogView->appendPlainText(msg);
+    statusBar()->showMessage(msg);
+}
+
 bool MainWindow::chooseRecordFilename(QString &fileName)
 {
     QFileDialog fileDialog(this, tr("Record"));
@@ -831,7 +960,8 @@ bool MainWindow::chooseRecordFilename(QString &fileName)
         firstFileDialog = false;
     }
     fileDialog.setAcceptMode(QFileDialog::AcceptSave);
-    fileDialog.setNameFilters(QStringList() << "WAVE file (*.wav)" << "AIFF file (*.aiff, *.aif)");
+    fileDialog.setNameFilters(QStringList() << "WAVE file (*.wav)" << "AIFF file (*.aiff, *.aif)"
+                              << "FLAC file (*.flac)" << "Ogg Vorbis file (*.ogg)");
     fileDialog.setDefaultSuffix("wav");
     if (fileDialog.exec() != QDialog::Accepted)
         return false;
@@ -845,15 +975,284 @@ void MainWindow::record()
     if (!chooseRecordFilename(fileName))
         return;
 //    qDebug() << "recording into file:" << fileName;
-    if (!playing)
-        playScore();
-    if (!recording) {
-        recording = true;
-        audio->startRecording(fileName);    // FIXME: this before playScore?
-        actionRecord->setEnabled(false);
-        recordButton->setEnabled(false);
+    if (recording)
+        return;
+    // Recover from a previous parse error now: doing it in playScore() would
+    // stop the take we're about to arm.
+    if (!playing && reinitRTcmixOnPlay) {
+        stopScore();
+        reinitRTcmixOnPlay = false;
     }
-//    qDebug("returned from startRecording");
+    if (!audio->armRecording(fileName))
+        return;
+    recording = true;
+    actionRecord->setEnabled(false);
+    recordButton->setEnabled(false);
+    if (!playing) {
+        playScore();                    // triggers the recording once the score parses
+        if (!playing && recording) {    // empty score: nothing will trigger it
+            audio->stopRecording();
+            actionRecord->setEnabled(true);
+            recordButton->setEnabled(true);
+            recording = false;
+        }
+    }
+    else
+        audio->triggerRecording();      // already playing: start with the next buffer
+}
+
+void MainWindow::saveHistory()
+{
+    QString fileName;
+    if (!chooseRecordFilename(fileName))
+        return;
+    if (audio->saveHistory(fileName))
+        statusBar()->showMessage(tr("Saving last %1 seconds to \"%2\"...").arg(audio->historySeconds()).arg(QDir::toNativeSeparators(fileName)));
+}
+
+void MainWindow::showHistorySaved(bool ok, const QString &message)
+{
+    const QString msg = ok ? QString(tr("Saved history to sound file")) : QString(tr("Error saving history: %1")).arg(message);
+    rtcmixLogView->appendPlainText(msg);
+    statusBar()->showMessage(msg);
+}
+
+// The history length comes from preferences, so this changes along with Audio.
+void MainWindow::updateSaveHistoryAction()
+{
+    if (audio->historyEnabled())
+        actionSaveHistory->setText(tr("Save &Last %1 Seconds...").arg(audio->historySeconds()));
+    else
+        actionSaveHistory->setText(tr("Save &Last Seconds..."));
+    actionSaveHistory->setEnabled(audio->historyEnabled());
+}
+
+void MainWindow::renderToFile()
+{
+    if (rendering)
+        return;
+    QString sco = curEditor->document()->toPlainText();
+    QByteArray ba = sco.toLatin1();
+    if (ba.isEmpty())
+        return;
+    if (!chooseRecordFilename(renderFileName))
+        return;
+
+    // The render thread needs RTcmix all to itself, so shut down playback
+    // and let go of the engine. It comes back in renderFinished().
+    stopScoreNoReinit();
+    audio->releaseRTcmix();
+
+    rtcmixLogView->startLog();
+    rtcmixLogView->printLogSeparator(this->fileName);
+    rendering = true;
+    actionPlay->setEnabled(false);
+    playButton->setEnabled(false);
+    actionRecord->setEnabled(false);
+    recordButton->setEnabled(false);
+    actionRender->setEnabled(false);
+    // Anything else that would reach RTcmix while the render thread owns it
+    actionPrefs->setEnabled(false);
+    actionAllowOverlappingScores->setEnabled(false);
+    actionFindBufferSize->setEnabled(false);
+    actionStop->setEnabled(true);
+    stopButton->setEnabled(true);
+    statusBar()->showMessage(tr("Rendering \"%1\"...").arg(QDir::toNativeSeparators(renderFileName)));
+
+    renderer = new OfflineRenderer(mainWindowPreferences->audioSamplingRate(),
+                                   mainWindowPreferences->audioNumOutputChannels(),
+                                   mainWindowPreferences->audioBufferSize(),
+                                   mainWindowPreferences->audioNumBuses(),
+                                   mainWindowPreferences->audioRecordBitDepth());
+    renderThreadController = new RenderThreadController(renderer, ba, renderFileName);
+    CHECKED_CONNECT(renderThreadController, &RenderThreadController::finished, this, &MainWindow::renderFinished);
+    renderThreadController->start();
+}
+
+void MainWindow::renderFinished(int status)
+{
+    delete renderThreadController;      // joins the render thread
+    renderThreadController = NULL;
+    rendering = false;
+
+    const QString shownName = QDir::toNativeSeparators(renderFileName);
+    if (status == OfflineRenderer::RenderOK) {
+        const QString msg = QString(tr("Rendered \"%1\": %2 sec of audio in %3 sec (%4x realtime)"))
+                .arg(shownName)
+                .arg(renderer->scoreSeconds(), 0, 'f', 2)
+                .arg(renderer->elapsedSeconds(), 0, 'f', 2)
+                .arg(renderer->realtimeFactor(), 0, 'f', 1);
+        rtcmixLogView->appendPlainText(msg);
+        statusBar()->showMessage(msg);
+    }
+    else if (status == OfflineRenderer::RenderCancelled)
+        statusBar()->showMessage(tr("Rendering \"%1\" cancelled").arg(shownName));
+    else if (status != OfflineRenderer::RenderParseError)
+        warnAlert(this, renderer->errorString());
+    delete renderer;
+    renderer = NULL;
+
+    actionRender->setEnabled(true);
+    actionPrefs->setEnabled(true);
+    actionAllowOverlappingScores->setEnabled(true);
+    actionFindBufferSize->setEnabled(true);
+    actionRecord->setEnabled(true);
+    recordButton->setEnabled(true);
+    actionStop->setEnabled(false);
+    stopButton->setEnabled(false);
+    actionPlay->setEnabled(true);
+    playButton->setEnabled(true);
+
+    // Take RTcmix back from the render thread.
+    RTcmix_setFinishedCallback(rtcmixFinishedCallback, this);
+    const bool isInteractive = (scorePlayMode == Overlapping);
+    audio->reinitializeRTcmix(isInteractive);
+    if (isInteractive)
+        audio->startAudio();
+}
+
+// The tuner needs the audio device and RTcmix to itself, so Audio goes away
+// until bufferTunerFinished(). The progress dialog is only window-modal, which
+// on macOS leaves the menus live, so the actions that use <audio> are disabled
+// in the meantime.
+void MainWindow::findBestBufferSize()
+{
+    if (rendering || bufferTunerThreadController)
+        return;
+    QVector<int> sizes;
+    availableBufferSizes(mainWindowPreferences->audioOutputDeviceID(), sizes);
+    if (sizes.isEmpty())
+        return;
+
+    stopScoreNoReinit();
+    stopDeviceProbe();
+    delete audio;               // closes the device and destroys RTcmix
+    audio = NULL;
+    actionPlay->setEnabled(false);
+    playButton->setEnabled(false);
+    actionStop->setEnabled(false);
+    stopButton->setEnabled(false);
+    actionRecord->setEnabled(false);
+    recordButton->setEnabled(false);
+    actionRender->setEnabled(false);
+    actionSaveHistory->setEnabled(false);
+    actionPrefs->setEnabled(false);
+    actionAllowOverlappingScores->setEnabled(false);
+    actionFindBufferSize->setEnabled(false);
+
+    rtcmixLogView->appendPlainText(tr("Finding the best buffer size (about %1 sec per size)...")
+                                   .arg(BufferTuner::measureSeconds + 0.5, 0, 'f', 1));
+    bufferTuner = new BufferTuner(mainWindowPreferences->audioOutputDeviceID(),
+                                  mainWindowPreferences->audioSamplingRate(),
+                                  mainWindowPreferences->audioNumOutputChannels(),
+                                  mainWindowPreferences->audioNumBuses(),
+                                  mainWindowPreferences->audioLatencyProfile());
+    bufferTunerDialog = new QProgressDialog(tr("Measuring..."), tr("Cancel"), 0, sizes.size(), this);
+    bufferTunerDialog->setWindowModality(Qt::WindowModal);
+    bufferTunerDialog->setMinimumDuration(0);
+    bufferTunerDialog->setAutoClose(false);
+    bufferTunerDialog->setAutoReset(false);
+    bufferTunerDialog->setValue(0);
+
+    bufferTunerThreadController = new BufferTunerThreadController(bufferTuner, sizes);
+    CHECKED_CONNECT(bufferTunerThreadController, &BufferTunerThreadController::progress, this, &MainWindow::bufferTunerProgress);
+    CHECKED_CONNECT(bufferTunerThreadController, &BufferTunerThreadController::measured, this, &MainWindow::showAudioMessage);
+    CHECKED_CONNECT(bufferTunerThreadController, &BufferTunerThreadController::finished, this, &MainWindow::bufferTunerFinished);
+    CHECKED_CONNECT(bufferTunerDialog, &QProgressDialog::canceled, this, &MainWindow::cancelBufferTuner);
+    bufferTunerThreadController->start();
+}
+
+void MainWindow::bufferTunerProgress(int sizeIndex, int bufferSize)
+{
+    bufferTunerDialog->setLabelText(tr("Measuring a buffer size of %1 frames...").arg(bufferSize));
+    bufferTunerDialog->setValue(sizeIndex);
+}
+
+void MainWindow::cancelBufferTuner()
+{
+    if (bufferTuner)
+        bufferTuner->cancel();
+}
+
+void MainWindow::bufferTunerFinished(int bestSize)
+{
+    const bool cancelled = bufferTuner->isCancelled();
+    delete bufferTunerThreadController;     // joins the tuner thread
+    bufferTunerThreadController = NULL;
+    delete bufferTuner;
+    bufferTuner = NULL;
+    bufferTunerDialog->deleteLater();
+    bufferTunerDialog = NULL;
+
+    const int currentSize = mainWindowPreferences->audioBufferSize();
+    if (cancelled)
+        rtcmixLogView->appendPlainText(tr("Buffer size search cancelled"));
+    else if (bestSize == 0) {
+        const QString msg = tr("None of the buffer sizes played reliably on this device (see the log).");
+        rtcmixLogView->appendPlainText(msg);
+        warnAlert(this, msg);
+    }
+    else {
+        const QString msg = tr("Best buffer size: %1 frames (%2 ms)").arg(bestSize)
+                .arg(1000.0 * bestSize / mainWindowPreferences->audioSamplingRate(), 0, 'f', 1);
+        rtcmixLogView->appendPlainText(msg);
+        if (bestSize != currentSize) {
+            const QMessageBox::StandardButton answer = QMessageBox::question(this, tr("Find Best Buffer Size"),
+                    tr("%1.\nUse it instead of the current %2 frames?").arg(msg).arg(currentSize));
+            if (answer == QMessageBox::Yes)
+                mainWindowPreferences->setAudioBufferSize(bestSize);
+        }
+        else
+            statusBar()->showMessage(tr("%1 -- already in use").arg(msg));
+    }
+
+    // Bring audio back, with the new size if there is one.
+    RTcmix_setFinishedCallback(rtcmixFinishedCallback, this);
+    audio = new Audio;
+    startDeviceProbe();
+    actionPlay->setEnabled(true);
+    playButton->setEnabled(true);
+    actionRecord->setEnabled(true);
+    recordButton->setEnabled(true);
+    actionRender->setEnabled(true);
+    actionPrefs->setEnabled(true);
+    actionAllowOverlappingScores->setEnabled(true);
+    actionFindBufferSize->setEnabled(true);
+    updateSaveHistoryAction();
+    showXrunCounts(0, 0);
+    if (scorePlayMode == Overlapping)
+        audio->startAudio();
+}
+
+// Find out what the audio devices can do before anyone opens the preferences
+// dialog, which then reads it from the device cache instead of asking them.
+// The probe uses Audio's PortAudio session, so it has to be stopped before
+// Audio is deleted, and started again once the new one is up.
+void MainWindow::startDeviceProbe()
+{
+    if (deviceProbeThreadController)
+        return;
+    QVector<int> probeChannelCounts = { 1, 2, 4, 8 };
+    const int prefChans = mainWindowPreferences->audioNumOutputChannels();
+    if (!probeChannelCounts.contains(prefChans))
+        probeChannelCounts.append(prefChans);
+    deviceProbeThreadController = new DeviceProbeThreadController(mainWindowPreferences->audioOutputDeviceID(), probeChannelCounts);
+    CHECKED_CONNECT(deviceProbeThreadController, &DeviceProbeThreadController::finished, this, &MainWindow::deviceProbeFinished);
+    deviceProbeThreadController->start();
+}
+
+void MainWindow::stopDeviceProbe()
+{
+    delete deviceProbeThreadController;     // stops after the device it's on
+    deviceProbeThreadController = NULL;
+}
+
+void MainWindow::deviceProbeFinished(int devicesProbed)
+{
+    delete deviceProbeThreadController;     // joins the probe thread
+    deviceProbeThreadController = NULL;
+    if (devicesProbed > 0)
+        qDebug("Probed %d audio devices in the background", devicesProbed);
 }
 
 void MainWindow::debug()
@@ -5,18 +5,26 @@
 
 QT_BEGIN_NAMESPACE
 class QAction;
+class QLabel;
 class QMenu;
 class QPushButton;
 class QSettings;
 class QSplitter;
 class QPlainTextEdit;
+class QProgressDialog;
 class QTimer;
 QT_END_NAMESPACE
 class Audio;
+class BufferTuner;
+class BufferTunerThreadController;
+class DeviceProbeThreadController;
 class FindDialog;
 class Led;
+class LevelMeter;
+class OfflineRenderer;
 class RTcmixLogView;
 class Preferences;
+class RenderThreadController;
 #include "editor.h"
 #include "highlighter.h"
 
@@ -31,6 +39,7 @@ public:
     bool loadFile(const QString &);
     void reinitializeAudio();
     Highlighter *getHighlighter() { return curEditor->getHighlighter(); }
+    Audio *getAudio() { return audio; }
 
     bool scoreFinished;
 
@@ -46,6 +55,12 @@ public slots:
     void fileOpenNoDialog(const QString &);
     void stopScore();
     void showClipping(int);
+    void showMeterLevels(const QVector<float> &, const QVector<float> &, const QVector<float> &);
+    void showTruePeakLevels(const QVector<float> &);
+    void showDspLoad(float, float, float, float);
+    void showXrunCounts(int, int);
+    void showAudioMessage(const QString &);
+    void showHistorySaved(bool, const QString &);
 
 private slots:
     void about();
@@ -54,6 +69,14 @@ private slots:
     bool fileSaveAs();
     void playScore();
     void record();
+    void renderToFile();
+    void renderFinished(int);
+    void saveHistory();
+    void findBestBufferSize();
+    void bufferTunerProgress(int, int);
+    void bufferTunerFinished(int);
+    void cancelBufferTuner();
+    void deviceProbeFinished(int);
     void clipboardDataChanged();
     void checkScoreFinished();
     void setScorePlayMode();
@@ -67,6 +90,7 @@ private:
     void createTextActions();
     void createMenus();
     void createToolbars();
+    void createStatusBar();
     void initFonts();
     void createEditors();
     void createVerticalSplitter();
@@ -85,6 +109,10 @@ private:
     void stopScoreNoReinit();
     void sendScoreFragment(char *);
     bool chooseRecordFilename(QString &);
+    void showRecordStats();
+    void updateSaveHistoryAction();
+    void startDeviceProbe();
+    void stopDeviceProbe();
     void loadSettings();
     void saveSettings();
     void debug();
@@ -117,6 +145,9 @@ private:
     QAction *actionPlay;
     QAction *actionStop;
     QAction *actionRecord;
+    QAction *actionRender;
+    QAction *actionSaveHistory;
+    QAction *actionFindBufferSize;
     QAction *actionAllowOverlappingScores;
     QAction *actionClearLog;
     QMenu *fileMenu;
@@ -126,7 +157,17 @@ private:
     QPushButton *stopButton;
     QPushButton *recordButton;
     Led *clippingIndicator;
+    LevelMeter *levelMeter;
+    QLabel *dspLoadLabel;
+    QLabel *xrunLabel;
     QTimer *scoreFinishedTimer;
+    OfflineRenderer *renderer;
+    RenderThreadController *renderThreadController;
+    QString renderFileName;
+    BufferTuner *bufferTuner;
+    BufferTunerThreadController *bufferTunerThreadController;
+    QProgressDialog *bufferTunerDialog;
+    DeviceProbeThreadController *deviceProbeThreadController;
 
     enum ScorePlayMode {
         Exclusive = 0,   // playing a new score not permitted until prev one stops
@@ -135,6 +176,7 @@ private:
     ScorePlayMode scorePlayMode;
     bool playing;
     bool recording;
+    bool rendering;
     bool reinitRTcmixOnPlay;
     bool firstFileDialog;
     int tabWidth;
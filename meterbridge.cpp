@@ -0,0 +1,95 @@
+#include <math.h>
+#include "meterbridge.h"
+
+const int newDataFlag = 4;
+const int slotIndexMask = 3;
+const double meterWindowSeconds = 1.0 / 30.0;
+const double peakHoldSeconds = 1.5;
+
+MeterBridge::MeterBridge(int numChans, float samplingRate)
+    : numChans(numChans)
+    , middle(1)
+    , back(0)
+    , front(2)
+    , windowFrames(0)
+{
+    for (int i = 0; i < 3; i++) {
+        snapshots[i].peak = new float [numChans]();
+        snapshots[i].rms = new float [numChans]();
+        snapshots[i].peakHold = new float [numChans]();
+    }
+    windowLength = long(samplingRate * meterWindowSeconds);
+    windowPeak = new float [numChans]();
+    windowSumSquares = new double [numChans]();
+    holdLength = long(samplingRate * peakHoldSeconds);
+    holdPeak = new float [numChans]();
+    holdFramesLeft = new long [numChans]();
+}
+
+MeterBridge::~MeterBridge()
+{
+    for (int i = 0; i < 3; i++) {
+        delete [] snapshots[i].peak;
+        delete [] snapshots[i].rms;
+        delete [] snapshots[i].peakHold;
+    }
+    delete [] windowPeak;
+    delete [] windowSumSquares;
+    delete [] holdPeak;
+    delete [] holdFramesLeft;
+}
+
+void MeterBridge::process(const float *samps, unsigned long frameCount)
+{
+    for (unsigned long f = 0; f < frameCount; f++) {
+        for (int c = 0; c < numChans; c++) {
+            const float samp = *samps++;
+            const float mag = fabsf(samp);
+            if (mag > windowPeak[c])
+                windowPeak[c] = mag;
+            windowSumSquares[c] += double(samp) * samp;
+        }
+    }
+    // Publish at buffer boundaries, once the window is full.
+    windowFrames += long(frameCount);
+    if (windowFrames >= windowLength)
+        publish();
+}
+
+void MeterBridge::publish()
+{
+    Snapshot &snap = snapshots[back];
+    for (int c = 0; c < numChans; c++) {
+        const float peak = windowPeak[c];
+        if (peak >= holdPeak[c]) {
+            holdPeak[c] = peak;
+            holdFramesLeft[c] = holdLength;
+        }
+        else {
+            holdFramesLeft[c] -= windowFrames;
+            if (holdFramesLeft[c] <= 0)
+                holdPeak[c] = peak;
+        }
+        snap.peak[c] = peak;
+        snap.rms[c] = float(sqrt(windowSumSquares[c] / windowFrames));
+        snap.peakHold[c] = holdPeak[c];
+        windowPeak[c] = 0.0f;
+        windowSumSquares[c] = 0.0;
+    }
+    windowFrames = 0;
+    back = middle.exchange(back | newDataFlag, std::memory_order_acq_rel) & slotIndexMask;
+}
+
+bool MeterBridge::read(float *peak, float *rms, float *peakHold)
+{
+    if ((middle.load(std::memory_order_acquire) & newDataFlag) == 0)
+        return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & slotIndexMask;
+    const Snapshot &snap = snapshots[front];
+    for (int c = 0; c < numChans; c++) {
+        peak[c] = snap.peak[c];
+        rms[c] = snap.rms[c];
+        peakHold[c] = snap.peakHold[c];
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef METERBRIDGE_H
+#define METERBRIDGE_H
+
+#include <atomic>
+
+// Per-channel level metering, passed from the audio callback to the GUI
+// without locks. The callback accumulates peak and sum of squares over a
+// window of about 1/30 sec, then publishes peak, RMS and peak-hold for the
+// window through a triple buffer: it always has a slot of its own to fill,
+// and swaps it with the shared middle slot when done. The GUI thread swaps its
+// own slot with the middle one when there's something new. Neither side ever
+// waits for the other, and a reader never sees a half-written snapshot.
+
+class MeterBridge
+{
+public:
+    MeterBridge(int numChans, float samplingRate);
+    ~MeterBridge();
+
+    // Audio callback only.
+    void process(const float *samps, unsigned long frameCount);
+
+    // GUI thread only. Copies the latest levels (linear amplitude) into
+    // arrays of channelCount() floats; returns false if none since last time.
+    bool read(float *peak, float *rms, float *peakHold);
+
+    int channelCount() const { return numChans; }
+
+private:
+    void publish();
+
+    struct Snapshot {
+        float *peak;
+        float *rms;
+        float *peakHold;
+    };
+
+    int numChans;
+    Snapshot snapshots[3];
+    std::atomic<int> middle;    // index of the shared slot, plus newDataFlag
+    int back;                   // callback's slot
+    int front;                  // GUI's slot
+
+    // callback only
+    long windowLength;
+    long windowFrames;
+    float *windowPeak;
+    double *windowSumSquares;
+    long holdLength;
+    float *holdPeak;
+    long *holdFramesLeft;
+};
+
+#endif // METERBRIDGE_H
@@ -12,6 +12,8 @@
 
 const int minNumBuses = 8;
 const int maxNumBuses = 96;
+const int maxRecordSegmentMinutes = 24 * 60;
+const int maxRecordSegmentMegabytes = 1000000;
 
 
 // SelectColorButton adapted from jpo38 at https://stackoverflow.com/questions/18257281/qt-color-picker-widget.
@@ -101,7 +103,20 @@ AudioTab::AudioTab(QWidget *parent) : QWidget(parent)
     Input Channels:  [QSpinBox: 1-16]
     Output Channels: [QSpinBox: 1-16]
     Buffer Size:     [popup menu: e.g., 64, 128, 256, 512, 1024, 2048, 4096]
+    Device Buffer:   [popup menu: Same as Buffer Size, Host Chooses, 32-4096]
+    Latency:         [popup menu: Lowest, Balanced, Safe]
+    Actual Latency:  [label: output and input latency of the open stream]
     Internal Buses:  [QSpinbox: 8-64]
+    Record Buffer:   [QDoubleSpinBox: 0.25-60 sec]
+    Record Format:   [popup menu: 32-bit float, 24-bit, 16-bit]
+    Split Every:     [QSpinBox: Never, 1-1440 min]
+    Split At Size:   [QSpinBox: Never, 1-1000000 MB]
+    Channel Files:   [x] One mono file per channel
+    Keep History:    [QSpinBox: Off, 1-600 sec]
+    Render Ahead:    [QSpinBox: Off, 1-8 buffers]
+    Real-Time:       [x] Lock memory, raise priority, flush denormals
+    Priority:        [QSpinBox: 1-99]
+    Audio CPU:       [QSpinBox: Any, 0-(cores - 1)]
 
     (outside grid layout)
     [x] Warn when choosing Allow Overlapping Scores
@@ -136,9 +151,78 @@ AudioTab::AudioTab(QWidget *parent) : QWidget(parent)
 
     bufferSizeMenu = new QComboBox();
 
+    deviceBufferSizeMenu = new QComboBox();
+    latencyProfileMenu = new QComboBox();
+    latencyProfileMenu->addItem(tr("Lowest"), LatencyLowest);
+    latencyProfileMenu->addItem(tr("Balanced"), LatencyBalanced);
+    latencyProfileMenu->addItem(tr("Safe"), LatencySafe);
+    latencyProfileMenu->setToolTip(tr("How much latency to ask the audio device for, between its own low and high defaults. "
+                                      "More latency means fewer dropouts."));
+
+    streamLatencyLabel = new QLabel();
+    streamLatencyLabel->setToolTip(tr("The latency the audio device actually gave us"));
+
+    deviceBufferSizeMenu->setToolTip(tr("Frames per audio device callback, if different from the buffer size RTcmix computes at a time"));
+
     numBusesSpin = new QSpinBox();
     numBusesSpin->setRange(minNumBuses, maxNumBuses);
 
+    recordBufferSpin = new QDoubleSpinBox();
+    recordBufferSpin->setRange(minRecordBufferSeconds, maxRecordBufferSeconds);
+    recordBufferSpin->setSingleStep(0.25);
+    recordBufferSpin->setSuffix(tr(" sec"));
+    recordBufferSpin->setToolTip(tr("How much audio can pile up while recording before the disk must catch up"));
+
+    recordFormatMenu = new QComboBox();
+    recordFormatMenu->addItem(tr("32-bit float"), 32);
+    recordFormatMenu->addItem(tr("24-bit"), 24);
+    recordFormatMenu->addItem(tr("16-bit"), 16);
+    recordFormatMenu->setToolTip(tr("Sample format for recorded and rendered sound files (24- and 16-bit are dithered)"));
+
+    recordSegmentMinutesSpin = new QSpinBox();
+    recordSegmentMinutesSpin->setRange(0, maxRecordSegmentMinutes);
+    recordSegmentMinutesSpin->setSpecialValueText(tr("Never"));
+    recordSegmentMinutesSpin->setSuffix(tr(" min"));
+    recordSegmentMinutesSpin->setToolTip(tr("Continue long recordings in a new numbered file after this many minutes"));
+
+    recordSegmentMegabytesSpin = new QSpinBox();
+    recordSegmentMegabytesSpin->setRange(0, maxRecordSegmentMegabytes);
+    recordSegmentMegabytesSpin->setSpecialValueText(tr("Never"));
+    recordSegmentMegabytesSpin->setSuffix(tr(" MB"));
+    recordSegmentMegabytesSpin->setToolTip(tr("Continue long recordings in a new numbered file when a file reaches this size"));
+
+    recordSplitChannels = new QCheckBox(tr("One mono file per channel"));
+    recordSplitChannels->setToolTip(tr("Record each output channel to its own file, named like \"take-ch1.wav\""));
+
+    historySecondsSpin = new QSpinBox();
+    historySecondsSpin->setRange(0, maxHistorySeconds);
+    historySecondsSpin->setSingleStep(10);
+    historySecondsSpin->setSpecialValueText(tr("Off"));
+    historySecondsSpin->setSuffix(tr(" sec"));
+    historySecondsSpin->setToolTip(tr("How much of what just played Save Last Seconds can write to a sound file"));
+
+    renderAheadSpin = new QSpinBox();
+    renderAheadSpin->setRange(0, maxRenderAheadBlocks);
+    renderAheadSpin->setSpecialValueText(tr("Off"));
+    renderAheadSpin->setSuffix(tr(" buffers"));
+    renderAheadSpin->setToolTip(tr("Compute audio this many buffers ahead on a separate thread, so that an occasional "
+                                   "slow buffer doesn't cause a dropout. Adds the same number of buffers of latency."));
+
+    realtimeHardening = new QCheckBox(tr("Lock memory, raise priority, flush denormals"));
+    realtimeHardening->setToolTip(tr("Lock the program in memory, run the audio thread at real-time (SCHED_FIFO) priority "
+                                     "on a chosen CPU, and flush denormals to zero on it. Results appear in the log."));
+
+    realtimePrioritySpin = new QSpinBox();
+    realtimePrioritySpin->setRange(1, 99);
+    realtimePrioritySpin->setToolTip(tr("SCHED_FIFO priority for the audio thread"));
+
+    realtimeCPUSpin = new QSpinBox();
+    realtimeCPUSpin->setRange(-1, qMax(0, QThread::idealThreadCount() - 1));
+    realtimeCPUSpin->setSpecialValueText(tr("Any"));
+    realtimeCPUSpin->setToolTip(tr("Run the audio thread only on this CPU core (numbered from 0)"));
+    CHECKED_CONNECT(realtimeHardening, &QCheckBox::toggled, realtimePrioritySpin, &QWidget::setEnabled);
+    CHECKED_CONNECT(realtimeHardening, &QCheckBox::toggled, realtimeCPUSpin, &QWidget::setEnabled);
+
     warnOverlappingScores = new QCheckBox(tr("Warn when choosing Allow Overlapping Scores"));
 
     // set up layouts
@@ -162,7 +246,20 @@ AudioTab::AudioTab(QWidget *parent) : QWidget(parent)
     audioLayout->addRow(tr("Channels:"), outChannelsSpin);
 #endif
     audioLayout->addRow(tr("Buffer Size:"), bufferSizeMenu);
+    audioLayout->addRow(tr("Device Buffer:"), deviceBufferSizeMenu);
+    audioLayout->addRow(tr("Latency:"), latencyProfileMenu);
+    audioLayout->addRow(tr("Actual Latency:"), streamLatencyLabel);
     audioLayout->addRow(tr("Internal Buses:"), numBusesSpin);
+    audioLayout->addRow(tr("Record Buffer:"), recordBufferSpin);
+    audioLayout->addRow(tr("Record Format:"), recordFormatMenu);
+    audioLayout->addRow(tr("Split Every:"), recordSegmentMinutesSpin);
+    audioLayout->addRow(tr("Split At Size:"), recordSegmentMegabytesSpin);
+    audioLayout->addRow(tr("Channel Files:"), recordSplitChannels);
+    audioLayout->addRow(tr("Keep History:"), historySecondsSpin);
+    audioLayout->addRow(tr("Render Ahead:"), renderAheadSpin);
+    audioLayout->addRow(tr("Real-Time:"), realtimeHardening);
+    audioLayout->addRow(tr("Priority:"), realtimePrioritySpin);
+    audioLayout->addRow(tr("Audio CPU:"), realtimeCPUSpin);
     audioLayout->setHorizontalSpacing(10);  // default appears to be 10 -- too tight
     audioGroupBox->setLayout(audioLayout);
 
@@ -275,9 +372,57 @@ void AudioTab::initFromPreferences(Preferences *prefs)
     menuIndex = bufferSizeMenu->findText(str);
     bufferSizeMenu->setCurrentIndex(menuIndex);
 
+    // device buffer size
+    deviceBufferSizeMenu->clear();
+    deviceBufferSizeMenu->addItem(tr("Same as Buffer Size"), -1);
+    deviceBufferSizeMenu->addItem(tr("Host Chooses"), 0);
+    for (int i = 0; i < bufferSizes.size(); i++)
+        deviceBufferSizeMenu->addItem(QString::number(bufferSizes.at(i)), bufferSizes.at(i));
+    menuIndex = deviceBufferSizeMenu->findData(prefs->audioDeviceBufferSize());
+    deviceBufferSizeMenu->setCurrentIndex(menuIndex >= 0 ? menuIndex : 0);
+
+    // latency
+    menuIndex = latencyProfileMenu->findData(prefs->audioLatencyProfile());
+    latencyProfileMenu->setCurrentIndex(menuIndex >= 0 ? menuIndex : 0);
+    MainWindow *mw = getMainWindow();
+    Audio *audio = mw ? mw->getAudio() : NULL;
+    if (audio && audio->outputLatency() > 0.0) {
+        QString latency = QString(tr("output %1 ms")).arg(audio->outputLatency() * 1000.0, 0, 'f', 1);
+        if (audio->inputLatency() > 0.0)
+            latency += QString(tr(", input %1 ms")).arg(audio->inputLatency() * 1000.0, 0, 'f', 1);
+        streamLatencyLabel->setText(latency);
+    }
+    else
+        streamLatencyLabel->setText(tr("(audio device not open)"));
+
     // buses
     numBusesSpin->setValue(prefs->audioNumBuses());
 
+    // record buffer
+    recordBufferSpin->setValue(prefs->audioRecordBufferSeconds());
+
+    // record format
+    menuIndex = recordFormatMenu->findData(prefs->audioRecordBitDepth());
+    recordFormatMenu->setCurrentIndex(menuIndex >= 0 ? menuIndex : 0);
+
+    // record segments
+    recordSegmentMinutesSpin->setValue(prefs->audioRecordSegmentMinutes());
+    recordSegmentMegabytesSpin->setValue(prefs->audioRecordSegmentMegabytes());
+
+    recordSplitChannels->setChecked(prefs->audioRecordSplitChannels());
+
+    // history
+    historySecondsSpin->setValue(prefs->audioHistorySeconds());
+
+    renderAheadSpin->setValue(prefs->audioRenderAheadBlocks());
+
+    // real-time hardening
+    realtimeHardening->setChecked(prefs->audioRealtimeHardening());
+    realtimePrioritySpin->setValue(prefs->audioRealtimePriority());
+    realtimeCPUSpin->setValue(prefs->audioRealtimeCPU());
+    realtimePrioritySpin->setEnabled(realtimeHardening->isChecked());
+    realtimeCPUSpin->setEnabled(realtimeHardening->isChecked());
+
     // overlapping scores warning alert
     warnOverlappingScores->setChecked(prefs->audioShowOverlappingScoresWarning());
 
@@ -345,12 +490,84 @@ void AudioTab::applyPreferences(Preferences *prefs)
     if (newVal != oldVal)
         changed = true;
 
+    oldVal = prefs->audioLatencyProfile();
+    newVal = latencyProfileMenu->currentData().toInt();
+    prefs->setAudioLatencyProfile(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    oldVal = prefs->audioDeviceBufferSize();
+    newVal = deviceBufferSizeMenu->currentData().toInt();
+    prefs->setAudioDeviceBufferSize(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
     oldVal = prefs->audioNumBuses();
     newVal = numBusesSpin->value();
     prefs->setAudioNumBuses(newVal);
     if (newVal != oldVal)
         changed = true;
 
+    double oldSecs = prefs->audioRecordBufferSeconds();
+    double newSecs = recordBufferSpin->value();
+    prefs->setAudioRecordBufferSeconds(newSecs);
+    if (newSecs != oldSecs)
+        changed = true;
+
+    oldVal = prefs->audioRecordBitDepth();
+    newVal = recordFormatMenu->currentData().toInt();
+    prefs->setAudioRecordBitDepth(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    oldVal = prefs->audioRecordSegmentMinutes();
+    newVal = recordSegmentMinutesSpin->value();
+    prefs->setAudioRecordSegmentMinutes(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    oldVal = prefs->audioRecordSegmentMegabytes();
+    newVal = recordSegmentMegabytesSpin->value();
+    prefs->setAudioRecordSegmentMegabytes(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    bool oldSplit = prefs->audioRecordSplitChannels();
+    bool newSplit = recordSplitChannels->isChecked();
+    prefs->setAudioRecordSplitChannels(newSplit);
+    if (newSplit != oldSplit)
+        changed = true;
+
+    oldVal = prefs->audioHistorySeconds();
+    newVal = historySecondsSpin->value();
+    prefs->setAudioHistorySeconds(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    oldVal = prefs->audioRenderAheadBlocks();
+    newVal = renderAheadSpin->value();
+    prefs->setAudioRenderAheadBlocks(newVal);
+    if (newVal != oldVal)
+        changed = true;
+
+    bool oldHarden = prefs->audioRealtimeHardening();
+    bool newHarden = realtimeHardening->isChecked();
+    prefs->setAudioRealtimeHardening(newHarden);
+    if (newHarden != oldHarden)
+        changed = true;
+
+    oldVal = prefs->audioRealtimePriority();
+    newVal = realtimePrioritySpin->value();
+    prefs->setAudioRealtimePriority(newVal);
+    if (newVal != oldVal && newHarden)
+        changed = true;
+
+    oldVal = prefs->audioRealtimeCPU();
+    newVal = realtimeCPUSpin->value();
+    prefs->setAudioRealtimeCPU(newVal);
+    if (newVal != oldVal && newHarden)
+        changed = true;
+
     prefs->setAudioShowOverlappingScoresWarning(warnOverlappingScores->isChecked());
 
     if (changed) {
@@ -14,7 +14,9 @@ class QCheckBox;
 class QColor;
 class QComboBox;
 class QDialogButtonBox;
+class QDoubleSpinBox;
 class QFontComboBox;
+class QLabel;
 class QSpinBox;
 class QTabWidget;
 QT_END_NAMESPACE
@@ -84,7 +86,20 @@ private:
     QSpinBox *inChannelsSpin;
     QSpinBox *outChannelsSpin;
     QComboBox *bufferSizeMenu;
+    QComboBox *deviceBufferSizeMenu;
+    QComboBox *latencyProfileMenu;
+    QLabel *streamLatencyLabel;
     QSpinBox *numBusesSpin;
+    QDoubleSpinBox *recordBufferSpin;
+    QComboBox *recordFormatMenu;
+    QSpinBox *recordSegmentMinutesSpin;
+    QSpinBox *recordSegmentMegabytesSpin;
+    QCheckBox *recordSplitChannels;
+    QSpinBox *historySecondsSpin;
+    QSpinBox *renderAheadSpin;
+    QCheckBox *realtimeHardening;
+    QSpinBox *realtimePrioritySpin;
+    QSpinBox *realtimeCPUSpin;
     QCheckBox *warnOverlappingScores;
     QVector<int> audioAPIList;
     QVector<int> inputDeviceList;
@@ -275,9 +290,55 @@ public:
     int audioBufferSize() { return settings->value("audio/blockSize", 512).toInt(); }
     void setAudioBufferSize(int size) { settings->setValue("audio/blockSize", size); }
 
+    // 0 lowest, 1 balanced, 2 safe (see LatencyProfile in audio.h)
+    int audioLatencyProfile() { return settings->value("audio/latencyProfile", 0).toInt(); }
+    void setAudioLatencyProfile(int profile) { settings->setValue("audio/latencyProfile", profile); }
+
+    // Frames per device callback: -1 means the same as audioBufferSize (the
+    // RTcmix vector size), 0 lets the host choose, and may vary per callback
+    int audioDeviceBufferSize() { return settings->value("audio/deviceBlockSize", -1).toInt(); }
+    void setAudioDeviceBufferSize(int size) { settings->setValue("audio/deviceBlockSize", size); }
+
     int audioNumBuses() { return settings->value("audio/numBuses", 32).toInt(); }
     void setAudioNumBuses(int numBuses) { settings->setValue("audio/numBuses", numBuses); }
 
+    double audioRecordBufferSeconds() { return settings->value("audio/recordBufferSeconds", 2.0).toDouble(); }
+    void setAudioRecordBufferSeconds(double seconds) { settings->setValue("audio/recordBufferSeconds", seconds); }
+
+    // 32 (float), 24 or 16
+    int audioRecordBitDepth() { return settings->value("audio/recordBitDepth", 32).toInt(); }
+    void setAudioRecordBitDepth(int bits) { settings->setValue("audio/recordBitDepth", bits); }
+
+    // 0 means don't split recordings by length or size
+    int audioRecordSegmentMinutes() { return settings->value("audio/recordSegmentMinutes", 0).toInt(); }
+    void setAudioRecordSegmentMinutes(int minutes) { settings->setValue("audio/recordSegmentMinutes", minutes); }
+
+    int audioRecordSegmentMegabytes() { return settings->value("audio/recordSegmentMegabytes", 0).toInt(); }
+    void setAudioRecordSegmentMegabytes(int megabytes) { settings->setValue("audio/recordSegmentMegabytes", megabytes); }
+
+    bool audioRecordSplitChannels() { return settings->value("audio/recordSplitChannels", false).toBool(); }
+    void setAudioRecordSplitChannels(bool split) { settings->setValue("audio/recordSplitChannels", split); }
+
+    // 0 turns off the history buffer used by Save Last Seconds
+    int audioHistorySeconds() { return settings->value("audio/historySeconds", 60).toInt(); }
+    void setAudioHistorySeconds(int seconds) { settings->setValue("audio/historySeconds", seconds); }
+
+    // Buffers RTcmix computes ahead of the audio callback; 0 turns this off
+    int audioRenderAheadBlocks() { return settings->value("audio/renderAheadBlocks", 0).toInt(); }
+    void setAudioRenderAheadBlocks(int blocks) { settings->setValue("audio/renderAheadBlocks", blocks); }
+
+    // Off by default: SCHED_FIFO and mlockall need rtprio and memlock limits
+    // (or privileges) that most systems don't grant.
+    bool audioRealtimeHardening() { return settings->value("audio/realtimeHardening", false).toBool(); }
+    void setAudioRealtimeHardening(bool harden) { settings->setValue("audio/realtimeHardening", harden); }
+
+    int audioRealtimePriority() { return settings->value("audio/realtimePriority", 70).toInt(); }
+    void setAudioRealtimePriority(int priority) { settings->setValue("audio/realtimePriority", priority); }
+
+    // -1 means any CPU
+    int audioRealtimeCPU() { return settings->value("audio/realtimeCPU", -1).toInt(); }
+    void setAudioRealtimeCPU(int cpu) { settings->setValue("audio/realtimeCPU", cpu); }
+
 #ifdef MAYBE_NEVER // might not be a good idea
     bool audioAllowOverlappingScores() { return settings->value("audio/allowOverlappingScores", false).toBool(); }
     void setAudioAllowOverlappingScores(bool allow) { settings->setValue("audio/allowOverlappingScores", allow); }
@@ -1,14 +1,332 @@
 #include <atomic>
+#include <stdlib.h>
+#include <string.h>
 #include <QDebug>
+#include <QElapsedTimer>
 #include "record.h"
 
-std::atomic<bool> keepRecording;
+// How often (msec) to rewrite the sound file header during a take, so that
+// the file is playable up to that point even if we crash.
+const int headerUpdateInterval = 5000;
 
-RecordWorker::RecordWorker(int numOutChans, PaUtilRingBuffer *ringBuffer, SNDFILE *outFile, float *transferBuffer)
+// Samples converted per pass when writing 16/24-bit files.
+const int convertBufferSamps = 16384;
+
+// Frames deinterleaved per pass when writing a file per channel.
+const int splitBufferFrames = 4096;
+
+// Return the libsndfile major/minor format to use for the given file name,
+// based on its extension, or 0 if the extension isn't one we can write.
+// FLAC can't hold float samples, so we give it 24 bits instead. Vorbis
+// ignores the bit depth: it encodes the float samples directly.
+int soundFileFormatFromName(const QString &fileName, int bitDepth)
+{
+    int subFormat = SF_FORMAT_FLOAT;
+    if (bitDepth == recordBitDepth24)
+        subFormat = SF_FORMAT_PCM_24;
+    else if (bitDepth == recordBitDepth16)
+        subFormat = SF_FORMAT_PCM_16;
+
+    if (fileName.endsWith(".wav"))
+        return SF_FORMAT_RF64 | subFormat;     // see RecordFile::openSegment()
+    else if (fileName.endsWith(".aif") || fileName.endsWith(".aiff"))
+        return SF_FORMAT_AIFF | subFormat;
+    else if (fileName.endsWith(".flac"))
+        return SF_FORMAT_FLAC | (subFormat == SF_FORMAT_PCM_16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24);
+    else if (fileName.endsWith(".ogg"))
+        return SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+    return 0;
+}
+
+bool isCompressedSoundFileFormat(int format)
+{
+    const int majorFormat = format & SF_FORMAT_TYPEMASK;
+    return majorFormat == SF_FORMAT_FLAC || majorFormat == SF_FORMAT_OGG;
+}
+
+// The bit depth we have to convert float samples to for the given format.
+static int bitDepthFromFormat(int format)
+{
+    switch (format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_16:
+        return recordBitDepth16;
+    case SF_FORMAT_PCM_24:
+        return recordBitDepth24;
+    default:
+        return recordBitDepthFloat;
+    }
+}
+
+RecordFile::RecordFile()
+    : sndFile(NULL)
+    , bitDepth(recordBitDepthFloat)
+    , compressed(false)
+    , segmentSamps(0)
+    , segmentSampsWritten(0)
+    , segmentNumber(0)
+    , failed(false)
+    , convertBuffer(NULL)
+    , ditherSeed(0)
+    , splitChannels(false)
+    , splitBuffer(NULL)
+#ifdef USE_BLOCK_WRITER
+    , writer(NULL)
+#endif
+{
+    memset(&sfinfo, 0, sizeof(sfinfo));
+}
+
+RecordFile::~RecordFile()
+{
+    close();
+    delete [] convertBuffer;
+    delete [] splitBuffer;
+}
+
+// If <segmentMinutes> or <segmentMegabytes> is non-zero, the take is split
+// into numbered files (e.g., "take-001.wav", "take-002.wav") of at most that
+// length or size. For FLAC and Ogg, the size limit applies to the audio
+// before compression, so those segments come out smaller. With split channels,
+// channel 1 goes to "take-ch1.wav", and so on, each segmented the same way.
+bool RecordFile::open(const QString &fileName, int samplingRate, int numChans, int bitDepth,
+                      int segmentMinutes, int segmentMegabytes)
+{
+    sfinfo.samplerate = samplingRate;
+    sfinfo.channels = numChans;
+    sfinfo.format = soundFileFormatFromName(fileName, bitDepth);
+    if (sfinfo.format == 0) {
+        errorText = QString(QObject::tr("Invalid sound file name extension (must be \".wav\", \".aif\", \".aiff\", \".flac\" or \".ogg\""));
+        return false;
+    }
+    if (!sf_format_check(&sfinfo)) {
+        // e.g., libsndfile built without FLAC or Vorbis support
+        errorText = QString(QObject::tr("Invalid sound file format requested (RecordFile::open)"));
+        return false;
+    }
+
+    baseFileName = fileName;
+    compressed = isCompressedSoundFileFormat(sfinfo.format);
+    this->bitDepth = bitDepthFromFormat(sfinfo.format);
+
+    if (splitChannels && numChans > 1) {
+        const int dot = fileName.lastIndexOf('.');
+        for (int c = 0; c < numChans; c++) {
+            RecordFile *channelFile = new RecordFile();
+            channelFile->ditherSeed = uint32_t(c + 1);
+            channelFiles.append(channelFile);
+            const QString channelFileName = fileName.left(dot) + QString("-ch%1").arg(c + 1) + fileName.mid(dot);
+            if (!channelFile->open(channelFileName, samplingRate, 1, bitDepth, segmentMinutes, segmentMegabytes)) {
+                errorText = channelFile->errorString();
+                close();
+                return false;
+            }
+        }
+        splitBuffer = new float [numChans * splitBufferFrames];
+        channelBuffers.resize(numChans);
+        for (int c = 0; c < numChans; c++)
+            channelBuffers[c] = splitBuffer + c * splitBufferFrames;
+        return true;
+    }
+
+    sf_count_t segmentFrames = 0;
+    if (segmentMinutes > 0)
+        segmentFrames = sf_count_t(segmentMinutes) * 60 * samplingRate;
+    if (segmentMegabytes > 0) {
+        const sf_count_t bytesPerFrame = sf_count_t(numChans) * (this->bitDepth / 8);
+        const sf_count_t frames = qMax(sf_count_t(segmentMegabytes) * 1024 * 1024 / bytesPerFrame, sf_count_t(1));
+        if (segmentFrames == 0 || frames < segmentFrames)
+            segmentFrames = frames;
+    }
+    segmentSamps = segmentFrames * numChans;
+
+    if (!openSegment())
+        return false;
+
+    if (this->bitDepth != recordBitDepthFloat) {
+        convertBuffer = new int32_t [convertBufferSamps];
+        initDitherState(&dither, uint32_t(samplingRate) * uint32_t(numChans) + ditherSeed * 7919u);
+    }
+    return true;
+}
+
+QString RecordFile::segmentFileName(int number) const
+{
+    if (segmentSamps == 0)
+        return baseFileName;
+    const int dot = baseFileName.lastIndexOf('.');
+    return baseFileName.left(dot) + QString("-%1").arg(number, 3, 10, QChar('0')) + baseFileName.mid(dot);
+}
+
+bool RecordFile::openSegment()
+{
+    const QString fileName = segmentFileName(segmentNumber + 1);
+    SF_INFO info = sfinfo;      // libsndfile writes into this
+#ifdef USE_BLOCK_WRITER
+    writer = new BlockFileWriter();
+    if (writer->open(fileName))
+        sndFile = writer->openSoundFile(&info);
+    if (sndFile == NULL) {
+        errorText = writer->errorString();
+        delete writer;
+        writer = NULL;
+        failed = true;
+        return false;
+    }
+#else
+    QByteArray ba = fileName.toLocal8Bit();
+    sndFile = sf_open(ba.data(), SFM_WRITE, &info);
+    if (sndFile == NULL) {
+        errorText = QString(QObject::tr("Error opening sound file for recording\n(sf_open: %1)")).arg(sf_strerror(NULL));
+        failed = true;
+        return false;
+    }
+#endif
+    // An RF64 file that ends up smaller than 4 GB is written as a plain WAV file.
+    // This has to be set before any audio is written.
+    if ((sfinfo.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_RF64)
+        sf_command(sndFile, SFC_RF64_AUTO_DOWNGRADE, NULL, SF_TRUE);
+    segmentNumber++;
+    segmentSampsWritten = 0;
+    return true;
+}
+
+bool RecordFile::closeSegment()
+{
+    bool ok = true;
+    if (sndFile) {
+        if (sf_close(sndFile) != 0) {
+            errorText = QString(QObject::tr("Error closing sound file\n(sf_close: %1)")).arg(sf_strerror(sndFile));
+            ok = false;
+        }
+        sndFile = NULL;
+    }
+#ifdef USE_BLOCK_WRITER
+    if (writer) {
+        if (!writer->close() && ok) {
+            errorText = QString(QObject::tr("Error writing sound file"));
+            ok = false;
+        }
+        delete writer;
+        writer = NULL;
+    }
+#endif
+    if (!ok)
+        failed = true;
+    return ok;
+}
+
+// When a segment fills up, we close it and open the next one right here, in
+// the middle of a write if need be, so the segments join sample for sample.
+sf_count_t RecordFile::write(const float *samps, sf_count_t count)
+{
+    if (!channelFiles.isEmpty())
+        return writeSplit(samps, count);
+
+    sf_count_t sampsWritten = 0;
+    while (sampsWritten < count) {
+        if (segmentSamps > 0 && segmentSampsWritten == segmentSamps) {
+            if (!closeSegment() || !openSegment())
+                break;
+        }
+        if (sndFile == NULL)
+            break;
+        sf_count_t n = count - sampsWritten;
+        if (segmentSamps > 0)
+            n = qMin(n, segmentSamps - segmentSampsWritten);
+        const sf_count_t written = writeSamps(samps + sampsWritten, n);
+        sampsWritten += written;
+        segmentSampsWritten += written;
+        if (written != n)
+            break;
+    }
+    return sampsWritten;
+}
+
+// Deinterleave into per-channel buffers, and write each to its own file.
+// The ring's elements are whole frames, so <count> always is too.
+// Returns the number of interleaved samples consumed.
+sf_count_t RecordFile::writeSplit(const float *samps, sf_count_t count)
+{
+    const int numChans = sfinfo.channels;
+    sf_count_t sampsUsed = 0;
+    while (count - sampsUsed >= numChans) {
+        const sf_count_t frames = qMin((count - sampsUsed) / numChans, sf_count_t(splitBufferFrames));
+        if (!writeChannels(samps + sampsUsed, frames))
+            return sampsUsed;
+        sampsUsed += frames * numChans;
+    }
+    return sampsUsed;
+}
+
+bool RecordFile::writeChannels(const float *samps, sf_count_t frames)
+{
+    deinterleave(samps, channelBuffers.constData(), long(frames), sfinfo.channels);
+    bool ok = true;
+    for (int c = 0; c < channelFiles.size(); c++) {
+        if (channelFiles[c]->write(channelBuffers[c], frames) != frames)
+            ok = false;
+    }
+    return ok;
+}
+
+// Float samples go straight to libsndfile. For 16/24-bit files, we dither and
+// convert them here, on the writing thread, rather than let libsndfile
+// truncate them, and hand it integers that it needn't convert again.
+sf_count_t RecordFile::writeSamps(const float *samps, sf_count_t count)
+{
+    if (bitDepth == recordBitDepthFloat)
+        return sf_write_float(sndFile, samps, count);
+
+    // libsndfile only takes whole frames, so convert a whole number of them at a time.
+    const sf_count_t chunkSamps = (convertBufferSamps / sfinfo.channels) * sfinfo.channels;
+    sf_count_t sampsWritten = 0;
+    while (sampsWritten < count) {
+        const sf_count_t n = qMin(count - sampsWritten, chunkSamps);
+        floatToIntDithered(samps + sampsWritten, convertBuffer, long(n), bitDepth, &dither);
+        const sf_count_t written = sf_write_int(sndFile, convertBuffer, n);
+        sampsWritten += written;
+        if (written != n)
+            break;
+    }
+    return sampsWritten;
+}
+
+// Make the header describe all the audio written so far. (FLAC and Ogg
+// streams are decodable as they go, and have no header to update.)
+void RecordFile::updateHeader()
+{
+    for (int c = 0; c < channelFiles.size(); c++)
+        channelFiles[c]->updateHeader();
+    if (sndFile == NULL)
+        return;
+    if (!compressed)
+        sf_command(sndFile, SFC_UPDATE_HEADER_NOW, NULL, 0);
+#ifdef USE_BLOCK_WRITER
+    writer->flush();
+#endif
+}
+
+bool RecordFile::close()
+{
+    bool ok = true;
+    for (int c = 0; c < channelFiles.size(); c++) {
+        if (!channelFiles[c]->close() && ok) {
+            errorText = channelFiles[c]->errorString();
+            ok = false;
+        }
+        delete channelFiles[c];
+    }
+    channelFiles.clear();
+    return closeSegment() && ok && !failed;
+}
+
+
+RecordWorker::RecordWorker(int numOutChans, PaUtilRingBuffer *ringBuffer, RecordFile *outFile, int drainInterval)
         : numOutChans(numOutChans)
         , ringBuffer(ringBuffer)
         , outFile(outFile)
-        , transferBuffer(transferBuffer)
+        , drainInterval(drainInterval)
+        , keepRecording(true)
 {
 }
 
@@ -16,42 +334,128 @@ RecordWorker::~RecordWorker()
 {
 }
 
+// Called from the main thread.
+void RecordWorker::stop()
+{
+    keepRecording = false;
+    wakeup.release();
+}
+
+// Write everything that's in the ring buffer now. Return number of samps written.
+// We hand the ring's own memory to libsndfile -- in one piece, or two if the
+// data wraps around the end of the ring -- rather than copying it out first.
+// The ring's elements are whole frames, so each piece is frame-aligned.
+int RecordWorker::drain()
+{
+    ring_buffer_size_t framesAvail = PaUtil_GetRingBufferReadAvailable(ringBuffer);
+    if (framesAvail == 0)
+        return 0;
+    void *region1, *region2;
+    ring_buffer_size_t size1, size2;
+    ring_buffer_size_t framesRead = PaUtil_GetRingBufferReadRegions(ringBuffer, framesAvail, &region1, &size1, &region2, &size2);
+    if (framesRead != framesAvail)
+        qDebug("RecordWorker::drain(): ringbuf read request doesn't match frames delivered");
+    const sf_count_t sampsRead = sf_count_t(framesRead) * numOutChans;
+    sf_count_t sampsWritten = outFile->write((float *) region1, sf_count_t(size1) * numOutChans);
+    if (size2 > 0)
+        sampsWritten += outFile->write((float *) region2, sf_count_t(size2) * numOutChans);
+    if (sampsWritten != sampsRead)
+        qDebug().nospace() << "RecordWorker::drain(): RecordFile::write didn't write all the samps (" << sampsRead << " => " << sampsWritten;
+    // Only now can the callback reuse this part of the ring.
+    PaUtil_AdvanceRingBufferReadIndex(ringBuffer, framesRead);
+    return int(sampsWritten);
+}
+
 void RecordWorker::record()
 {
-//qDebug("entering RecordWorker::record()");
-//int totsampswritten = 0;
     // NB: This will write a total number of frames that is evenly divisible by the audio block size
+    QElapsedTimer sinceHeaderUpdate;
+    sinceHeaderUpdate.start();
     while (keepRecording) {
-        int sampsAvail = PaUtil_GetRingBufferReadAvailable(ringBuffer);
-        if (sampsAvail) {
-            int sampsRead = PaUtil_ReadRingBuffer(ringBuffer, transferBuffer, sampsAvail);
-            if (sampsRead != sampsAvail)
-                qDebug("RecordWorker::record(): ringbuf read request doesn't match samps delivered");
-//qDebug("RecordWorker::record(): sampsRead=%d", sampsRead);
-            sf_count_t sampsWritten = sf_write_float(outFile, transferBuffer, sampsRead);
-            if (sampsWritten != sampsRead)
-                qDebug().nospace() << "RecordWorker::record(): sf_write_float didn't write all the samps (" << sampsRead << " => " << sampsWritten;
-//totsampswritten += sampsRead;
-        }
+        wakeup.tryAcquire(1, drainInterval);
+        drain();
         //sf_write_sync(outFile);  messes up playback. call less frequently, or not at all?
+        if (sinceHeaderUpdate.elapsed() >= headerUpdateInterval) {
+            outFile->updateHeader();
+            sinceHeaderUpdate.restart();
+        }
     }
-    if (sf_close(outFile) != 0) {
-        const QString msg = QString(tr("Error closing recorded sound file\n(RecordWorker::record: sf_close: %1)")).arg(sf_strerror(outFile));
+    // Pick up whatever the callback wrote before it saw that we'd stopped.
+    drain();
+    if (!outFile->close()) {
+        const QString msg = QString(tr("Error closing recorded sound file\n(RecordWorker::record: %1)")).arg(outFile->errorString());
         warnAlert(nullptr, msg);
     }
-//qDebug("finished recording - frames written: %d", totsampswritten / 2);
+    delete outFile;
 
     emit finished();
 }
 
+HistoryWorker::~HistoryWorker()
+{
+    delete outFile;
+}
+
+// Copy the history out of the ring, oldest to newest, and return the copy, or
+// NULL with a <message> saying why not. The part to write starts <offsetSamps>
+// in, past the frames the callback may have reached during the copy.
+float *HistoryWorker::takeSnapshot(long long &offsetSamps, long long &numSamps, QString &message)
+{
+    const long long writtenBefore = framesWritten->load(std::memory_order_acquire);
+    const long long availFrames = qMin(writtenBefore, (long long) historyFrames);
+    const size_t frameBytes = numChans * sizeof(float);
+    float *snapshot = (float *) malloc(size_t(availFrames) * frameBytes);
+    if (snapshot == NULL) {
+        message = QString(tr("Not enough memory to copy the history"));
+        return NULL;
+    }
+    const long start = long((writtenBefore - availFrames) % historyFrames);
+    const long frames1 = long(qMin(availFrames, (long long) (historyFrames - start)));
+    memcpy(snapshot, history + start * numChans, frames1 * frameBytes);
+    memcpy(snapshot + frames1 * numChans, history, size_t(availFrames - frames1) * frameBytes);
+
+    const long long writtenAfter = framesWritten->load(std::memory_order_acquire);
+    const long long firstSafeFrame = writtenAfter + guardFrames - historyFrames;
+    const long long skipFrames = qBound(0LL, firstSafeFrame - (writtenBefore - availFrames), availFrames);
+    if (skipFrames == availFrames) {
+        free(snapshot);
+        message = QString(tr("Not enough audio history to save yet"));
+        return NULL;
+    }
+    offsetSamps = skipFrames * numChans;
+    numSamps = (availFrames - skipFrames) * numChans;
+    return snapshot;
+}
+
+void HistoryWorker::write()
+{
+    long long offsetSamps = 0, numSamps = 0;
+    QString message;
+    float *samps = takeSnapshot(offsetSamps, numSamps, message);
+    snapshotTaken->release();
+    bool ok = (samps != NULL);
+    if (ok && outFile->write(samps + offsetSamps, numSamps) != numSamps) {
+        message = QString(tr("Error writing history sound file"));
+        ok = false;
+    }
+    if (!outFile->close() && ok) {
+        message = outFile->errorString();
+        ok = false;
+    }
+    delete outFile;
+    outFile = NULL;
+    free(samps);
+    emit finished(ok, message);
+}
+
+
 void RecordThreadController::start()
 {
     worker->moveToThread(&workerThread);
-    keepRecording = true;
     workerThread.start(/*QThread::LowPriority*/);
 }
 
 void RecordThreadController::stop()
 {
-    keepRecording = false;
+    worker->stop();
 }
@@ -1,19 +1,90 @@
 #ifndef RECORD_H
 #define RECORD_H
 
+#include <atomic>
 #include <QObject>
+#include <QSemaphore>
 #include <QThread>
+#include <QVector>
+#include "blockwriter.h"
 #include "pa_ringbuffer.h"
+#include "sampleconvert.h"
 #include "sndfile.h"
 #include "utils.h"
 
+// Sample formats we can record and render, in bits per sample. Float is
+// written as is; the integer formats are dithered on the writing thread.
+const int recordBitDepthFloat = 32;
+const int recordBitDepth24 = 24;
+const int recordBitDepth16 = 16;
+
+int soundFileFormatFromName(const QString &, int bitDepth = recordBitDepthFloat);
+bool isCompressedSoundFileFormat(int format);
+
+// A sound file being recorded or rendered, possibly as a series of segment
+// files, or as one mono file per channel. Everything but open() runs on the
+// thread that writes the file.
+class RecordFile
+{
+public:
+    RecordFile();
+    ~RecordFile();
+
+    void setSplitChannels(bool split) { splitChannels = split; }     // call before open()
+    bool open(const QString &fileName, int samplingRate, int numChans, int bitDepth = recordBitDepthFloat,
+              int segmentMinutes = 0, int segmentMegabytes = 0);
+    sf_count_t write(const float *, sf_count_t);
+    void updateHeader();
+    bool close();
+    bool isCompressed() const { return compressed; }
+    int segmentCount() const { return segmentNumber; }
+    const QString &errorString() const { return errorText; }
+
+private:
+    QString segmentFileName(int) const;
+    bool openSegment();
+    bool closeSegment();
+    sf_count_t writeSamps(const float *, sf_count_t);
+    sf_count_t writeSplit(const float *, sf_count_t);
+    bool writeChannels(const float *, sf_count_t);
+
+    SNDFILE *sndFile;
+    SF_INFO sfinfo;
+    QString baseFileName;
+    int bitDepth;
+    bool compressed;            // FLAC or Ogg Vorbis
+    sf_count_t segmentSamps;    // 0 means the whole take goes in one file
+    sf_count_t segmentSampsWritten;
+    int segmentNumber;
+    bool failed;
+    int32_t *convertBuffer;     // dithered integer samples, for 16/24-bit files
+    DitherState dither;
+    uint32_t ditherSeed;        // differs for each channel file, so their dither is uncorrelated
+
+    // For split channels: a mono file per channel.
+    bool splitChannels;
+    QVector<RecordFile *> channelFiles;
+    float *splitBuffer;
+    QVector<float *> channelBuffers;
+#ifdef USE_BLOCK_WRITER
+    BlockFileWriter *writer;
+#endif
+    QString errorText;
+};
+
+// The record worker sleeps between drains of the ring buffer, rather than
+// polling it, so that it uses next to no CPU while recording. It wakes up
+// every <drainInterval> msec (short enough that the audio callback can't
+// fill the ring in the meantime) or as soon as it's told to stop, and then
+// writes everything that has accumulated in one batch.
 class RecordWorker : public QObject
 {
     Q_OBJECT
 
 public:
-    RecordWorker(int, PaUtilRingBuffer *, SNDFILE *, float *);
+    RecordWorker(int, PaUtilRingBuffer *, RecordFile *, int);
     ~RecordWorker();
+    void stop();
 
 public slots:
     void record();
@@ -22,10 +93,77 @@ signals:
     void finished();
 
 private:
+    int drain();
+
     int numOutChans;
     PaUtilRingBuffer *ringBuffer;
-    SNDFILE *outFile;
-    float *transferBuffer;
+    RecordFile *outFile;
+    int drainInterval;
+    std::atomic<bool> keepRecording;
+    QSemaphore wakeup;
+};
+
+// Writes the audio history (see Audio::saveHistory) to a file. The copy out
+// of Audio's history ring happens here too, since a long history can be most
+// of a gigabyte, which is no job for the GUI thread. The callback goes on
+// writing the ring meanwhile, so we drop whatever it may have overwritten by
+// the time the copy is done, plus <guardFrames> for a callback in progress.
+// Releases <snapshotTaken> once it's done with the ring. Takes ownership of
+// the file.
+class HistoryWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    HistoryWorker(const float *history, long historyFrames, int numChans, const std::atomic<long long> *framesWritten,
+                  long long guardFrames, RecordFile *outFile, QSemaphore *snapshotTaken)
+        : history(history), historyFrames(historyFrames), numChans(numChans), framesWritten(framesWritten),
+          guardFrames(guardFrames), outFile(outFile), snapshotTaken(snapshotTaken) {}
+    ~HistoryWorker();
+
+public slots:
+    void write();
+
+signals:
+    void finished(bool ok, const QString &message);
+
+private:
+    float *takeSnapshot(long long &offsetSamps, long long &numSamps, QString &message);
+
+    const float *history;
+    long historyFrames;
+    int numChans;
+    const std::atomic<long long> *framesWritten;
+    long long guardFrames;
+    RecordFile *outFile;
+    QSemaphore *snapshotTaken;
+};
+
+class HistoryThreadController : public QObject
+{
+    Q_OBJECT
+    QThread workerThread;
+    QSemaphore snapshotTaken;
+
+public:
+    HistoryThreadController(const float *history, long historyFrames, int numChans, const std::atomic<long long> *framesWritten,
+                            long long guardFrames, RecordFile *file) {
+        HistoryWorker *worker = new HistoryWorker(history, historyFrames, numChans, framesWritten, guardFrames, file, &snapshotTaken);
+        worker->moveToThread(&workerThread);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &HistoryWorker::write);
+        CHECKED_CONNECT(worker, &HistoryWorker::finished, this, &HistoryThreadController::finished);
+    }
+    ~HistoryThreadController() {
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start() { workerThread.start(); }
+    // Wait until the worker no longer reads the history ring.
+    void waitForSnapshot() { snapshotTaken.acquire(); snapshotTaken.release(); }
+
+signals:
+    void finished(bool ok, const QString &message);
 };
 
 class RecordThreadController : public QObject
@@ -36,8 +174,8 @@ class RecordThreadController : public QObject
     RecordWorker *worker;
 
 public:
-    RecordThreadController(int numChans, PaUtilRingBuffer *ringBuf, SNDFILE *file, float *transferBuffer) {
-        worker = new RecordWorker(numChans, ringBuf, file, transferBuffer);
+    RecordThreadController(int numChans, PaUtilRingBuffer *ringBuf, RecordFile *file, int drainInterval) {
+        worker = new RecordWorker(numChans, ringBuf, file, drainInterval);
         CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
         CHECKED_CONNECT(&workerThread, &QThread::started, worker, &RecordWorker::record);
     }
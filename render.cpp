@@ -0,0 +1,148 @@
+#include <QElapsedTimer>
+#include <QtDebug>
+
+#include "record.h"
+#include "render.h"
+#define EMBEDDEDAUDIO
+#include "RTcmix_API.h"
+
+void renderFinishedCallback(long long frameCount, void *inContext);
+
+
+OfflineRenderer::OfflineRenderer(float samplingRate, int numOutChannels, int bufferSize, int busCount, int bitDepth)
+    : scoreFinished(false)
+    , samplingRate(samplingRate)
+    , numOutChannels(numOutChannels)
+    , bufferSize(bufferSize)
+    , busCount(busCount)
+    , bitDepth(bitDepth)
+    , rtcmixInitialized(false)
+    , cancelled(false)
+    , frameCount(0)
+    , elapsed(0.0)
+{
+}
+
+OfflineRenderer::~OfflineRenderer()
+{
+}
+
+void renderFinishedCallback(long long frameCount, void *inContext)
+{
+    (void) frameCount;
+    OfflineRenderer *thisclass = reinterpret_cast<OfflineRenderer *>(inContext);
+    thisclass->scoreFinished = true;
+}
+
+OfflineRenderer::Status OfflineRenderer::initializeRTcmix()
+{
+    int status = RTcmix_init();
+    if (status != 0) {
+        errorText = QString(QObject::tr("Error initializing RTcmix\n(RTcmix_init: %1)")).arg(status);
+        return RenderInitError;
+    }
+    rtcmixInitialized = true;
+    status = RTcmix_setAudioBufferFormat(AudioFormat_32BitFloat_Normalized, numOutChannels);
+    if (status != 0) {
+        errorText = QString(QObject::tr("Error configuring RTcmix audio buffer\n(RTcmix_setAudioBufferFormat: %1)")).arg(status);
+        return RenderInitError;
+    }
+    const int takingInput = 0;
+    status = RTcmix_setparams(samplingRate, numOutChannels, bufferSize, takingInput, busCount);
+    if (status != 0) {
+        errorText = QString(QObject::tr("Error configuring RTcmix audio parameters\n(RTcmix_setparams: %1)")).arg(status);
+        return RenderInitError;
+    }
+    // Parse the whole score before running audio, as in Exclusive play mode.
+    RTcmix_setInteractive(0);
+    RTcmix_setFinishedCallback(renderFinishedCallback, this);
+    return RenderOK;
+}
+
+OfflineRenderer::Status OfflineRenderer::render(const QByteArray &score, const QString &fileName)
+{
+    frameCount = 0;
+    elapsed = 0.0;
+    scoreFinished = false;
+    errorText.clear();
+
+    Status status = initializeRTcmix();
+    if (status == RenderOK) {
+        QByteArray buf = score;     // RTcmix_parseScore wants a non-const buffer
+        if (RTcmix_parseScore(buf.data(), buf.size()) != 0) {
+            errorText = QString(QObject::tr("Error parsing score (see log)"));
+            status = RenderParseError;
+        }
+    }
+
+    const sf_count_t blockSamps = sf_count_t(bufferSize) * numOutChannels;
+    float *block = NULL;
+    if (status == RenderOK) {
+        block = (float *) calloc(blockSamps, sizeof(float));
+        if (block == NULL) {
+            errorText = QString(QObject::tr("Not enough memory for a %1 frame render buffer")).arg(bufferSize);
+            status = RenderInitError;
+        }
+    }
+
+    // Not until the score parses, so a parse error leaves no empty file behind.
+    RecordFile outFile;
+    if (status == RenderOK && !outFile.open(fileName, int(samplingRate), numOutChannels, bitDepth)) {
+        errorText = outFile.errorString();
+        status = RenderFileError;
+    }
+
+    if (status == RenderOK) {
+        QElapsedTimer timer;
+        timer.start();
+        while (!scoreFinished) {
+            if (cancelled) {
+                status = RenderCancelled;
+                break;
+            }
+            RTcmix_runAudio(NULL, block, bufferSize);
+            sf_count_t sampsWritten = outFile.write(block, blockSamps);
+            if (sampsWritten != blockSamps) {
+                errorText = QString(QObject::tr("Error writing rendered sound file\n(render: %1 of %2 samples written)")).arg(int(sampsWritten)).arg(int(blockSamps));
+                status = RenderWriteError;
+                break;
+            }
+            frameCount += bufferSize;
+        }
+        elapsed = timer.nsecsElapsed() / 1.0e9;
+    }
+    free(block);
+
+    if (rtcmixInitialized) {
+        RTcmix_destroy();
+        rtcmixInitialized = false;
+    }
+
+    if (!outFile.close() && status == RenderOK) {
+        errorText = outFile.errorString();
+        status = RenderWriteError;
+    }
+    return status;
+}
+
+
+// --------------------------------------------------------------------------
+
+RenderWorker::RenderWorker(OfflineRenderer *renderer, const QByteArray &score, const QString &fileName)
+        : renderer(renderer)
+        , score(score)
+        , fileName(fileName)
+{
+}
+
+void RenderWorker::render()
+{
+    OfflineRenderer::Status status = renderer->render(score, fileName);
+    emit finished(int(status));
+}
+
+void RenderThreadController::start()
+{
+    worker->moveToThread(&workerThread);
+    workerThread.start();
+}
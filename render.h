@@ -0,0 +1,102 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <atomic>
+#include <QByteArray>
+#include <QObject>
+#include <QString>
+#include <QThread>
+#include "utils.h"
+
+// Offline ("faster than realtime") rendering of a score straight into a sound
+// file. This does not touch PortAudio at all: we drive RTcmix_runAudio() in a
+// tight loop and hand each block to libsndfile, until RTcmix tells us that the
+// score has finished. Because RTcmix is a process-global singleton, the caller
+// must make sure nobody else has RTcmix initialized while render() runs.
+
+class OfflineRenderer
+{
+public:
+    enum Status {
+        RenderOK = 0,
+        RenderInitError,
+        RenderParseError,
+        RenderFileError,
+        RenderWriteError,
+        RenderCancelled
+    };
+
+    OfflineRenderer(float samplingRate, int numOutChannels, int bufferSize, int busCount, int bitDepth);
+    ~OfflineRenderer();
+
+    Status render(const QByteArray &score, const QString &fileName);
+    void cancel() { cancelled = true; }
+
+    const QString &errorString() const { return errorText; }
+    long long framesRendered() const { return frameCount; }
+    double elapsedSeconds() const { return elapsed; }
+    double scoreSeconds() const { return double(frameCount) / samplingRate; }
+    double realtimeFactor() const { return (elapsed > 0.0) ? scoreSeconds() / elapsed : 0.0; }
+
+    // Set by the RTcmix finished callback, which can arrive on an RTcmix thread.
+    std::atomic<bool> scoreFinished;
+
+private:
+    Status initializeRTcmix();
+
+    float samplingRate;
+    int numOutChannels;
+    int bufferSize;
+    int busCount;
+    int bitDepth;
+    bool rtcmixInitialized;
+    std::atomic<bool> cancelled;
+    long long frameCount;
+    double elapsed;
+    QString errorText;
+};
+
+class RenderWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    RenderWorker(OfflineRenderer *, const QByteArray &, const QString &);
+
+public slots:
+    void render();
+
+signals:
+    void finished(int status);
+
+private:
+    OfflineRenderer *renderer;
+    QByteArray score;
+    QString fileName;
+};
+
+class RenderThreadController : public QObject
+{
+    Q_OBJECT
+
+    QThread workerThread;
+    RenderWorker *worker;
+
+public:
+    RenderThreadController(OfflineRenderer *renderer, const QByteArray &score, const QString &fileName) {
+        worker = new RenderWorker(renderer, score, fileName);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &RenderWorker::render);
+        CHECKED_CONNECT(worker, &RenderWorker::finished, this, &RenderThreadController::finished);
+    }
+    ~RenderThreadController() {
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start();
+
+signals:
+    void finished(int status);
+};
+
+#endif // RENDER_H
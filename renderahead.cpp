@@ -0,0 +1,149 @@
+#include <chrono>
+#include "dspload.h"
+#include "renderahead.h"
+#include "rthardening.h"
+#define EMBEDDEDAUDIO
+#include "RTcmix_API.h"
+
+#if defined(Q_OS_DARWIN)
+#include <dispatch/dispatch.h>
+#elif defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+#endif
+
+#if defined(Q_OS_DARWIN)
+
+RenderAheadWakeup::RenderAheadWakeup()
+{
+    sem = dispatch_semaphore_create(0);
+}
+
+RenderAheadWakeup::~RenderAheadWakeup()
+{
+    dispatch_release((dispatch_semaphore_t) sem);
+}
+
+void RenderAheadWakeup::signal()
+{
+    dispatch_semaphore_signal((dispatch_semaphore_t) sem);
+}
+
+void RenderAheadWakeup::wait(int usec)
+{
+    dispatch_semaphore_wait((dispatch_semaphore_t) sem, dispatch_time(DISPATCH_TIME_NOW, int64_t(usec) * 1000));
+}
+
+#elif defined(Q_OS_WIN)
+
+RenderAheadWakeup::RenderAheadWakeup()
+{
+    sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+}
+
+RenderAheadWakeup::~RenderAheadWakeup()
+{
+    CloseHandle((HANDLE) sem);
+}
+
+void RenderAheadWakeup::signal()
+{
+    ReleaseSemaphore((HANDLE) sem, 1, NULL);
+}
+
+void RenderAheadWakeup::wait(int usec)
+{
+    WaitForSingleObject((HANDLE) sem, DWORD(qMax(1, usec / 1000)));
+}
+
+#else
+
+RenderAheadWakeup::RenderAheadWakeup()
+{
+    sem = new sem_t;
+    sem_init((sem_t *) sem, 0, 0);
+}
+
+RenderAheadWakeup::~RenderAheadWakeup()
+{
+    sem_destroy((sem_t *) sem);
+    delete (sem_t *) sem;
+}
+
+void RenderAheadWakeup::signal()
+{
+    sem_post((sem_t *) sem);
+}
+
+void RenderAheadWakeup::wait(int usec)
+{
+    // sem_timedwait only takes an absolute CLOCK_REALTIME time.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += long(usec) * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (sem_timedwait((sem_t *) sem, &deadline) != 0 && errno == EINTR)
+        ;
+}
+
+#endif
+
+
+RenderAheadWorker::RenderAheadWorker(PaUtilRingBuffer *queue, int aheadBlocks, int blockFrames, float samplingRate,
+                                     DspLoadMeter *dspLoad, bool realtime, int priority, RenderAheadWakeup *wakeup)
+    : queue(queue)
+    , aheadBlocks(aheadBlocks)
+    , blockFrames(blockFrames)
+    , samplingRate(samplingRate)
+    , dspLoad(dspLoad)
+    , realtime(realtime)
+    , priority(priority)
+    , wakeup(wakeup)
+    , keepRunning(true)
+{
+    waitInterval = qMax(1000, int(2.0e6 * blockFrames / samplingRate));
+}
+
+// Called from the main thread.
+void RenderAheadWorker::stop()
+{
+    keepRunning = false;
+    wakeup->signal();
+}
+
+// Keep the queue <aheadBlocks> deep. The callback wakes us each time it
+// finishes a block, so we usually start on the next one right away, and
+// otherwise sleep.
+void RenderAheadWorker::run()
+{
+    // RTcmix runs here now, so this is the thread that needs the hardening
+    // (but not the CPU pinning, which is for the callback).
+    if (realtime) {
+        setCurrentThreadRealtime(priority);
+        setCurrentThreadFlushDenormals();
+    }
+    const double period = blockFrames / samplingRate;
+    bool isPrimed = false;
+    while (keepRunning) {
+        if (PaUtil_GetRingBufferReadAvailable(queue) < aheadBlocks) {
+            void *block, *unused;
+            ring_buffer_size_t count, unusedCount;
+            PaUtil_GetRingBufferWriteRegions(queue, 1, &block, &count, &unused, &unusedCount);
+            const std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+            RTcmix_runAudio(NULL, block, blockFrames);
+            const std::chrono::duration<double> runTime = std::chrono::steady_clock::now() - runStart;
+            dspLoad->add(runTime.count() / period);
+            PaUtil_AdvanceRingBufferWriteIndex(queue, 1);
+            if (!isPrimed && PaUtil_GetRingBufferReadAvailable(queue) >= aheadBlocks) {
+                primed.release();
+                isPrimed = true;
+            }
+        }
+        else
+            wakeup->wait(waitInterval);
+    }
+}
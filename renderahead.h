@@ -0,0 +1,92 @@
+#ifndef RENDERAHEAD_H
+#define RENDERAHEAD_H
+
+#include <atomic>
+#include <QObject>
+#include <QSemaphore>
+#include <QThread>
+#include "pa_ringbuffer.h"
+#include "utils.h"
+
+class DspLoadMeter;
+
+// Render-ahead mode: RTcmix runs on its own high-priority thread, a few
+// blocks ahead of the audio callback, into a single-producer, single-consumer
+// queue of whole blocks. The callback only copies out the oldest block. A
+// block that takes RTcmix longer than a buffer period to compute then eats
+// into the queue instead of causing a dropout, at the cost of <aheadBlocks>
+// buffers of extra output latency.
+//
+// Only for output: live input would arrive that many buffers late.
+
+// How the callback wakes the render thread when it finishes a block. It can't
+// use a QSemaphore, which may take a lock, so this is a semaphore whose post
+// doesn't: a POSIX one (sem_post is async-signal-safe) on Linux and other
+// Unixes, a dispatch semaphore on macOS, which lacks unnamed POSIX ones, and a
+// kernel semaphore on Windows.
+class RenderAheadWakeup
+{
+public:
+    RenderAheadWakeup();
+    ~RenderAheadWakeup();
+    void signal();              // callback, or the main thread to stop
+    void wait(int usec);        // render thread: until signalled, or <usec> passes
+
+private:
+    void *sem;
+};
+
+class RenderAheadWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    RenderAheadWorker(PaUtilRingBuffer *queue, int aheadBlocks, int blockFrames, float samplingRate,
+                      DspLoadMeter *dspLoad, bool realtime, int priority, RenderAheadWakeup *wakeup);
+    void stop();
+    // Wait up to <msec> for the queue to fill for the first time.
+    bool waitPrimed(int msec) { return primed.tryAcquire(1, msec); }
+
+public slots:
+    void run();
+
+private:
+    PaUtilRingBuffer *queue;
+    int aheadBlocks;
+    int blockFrames;
+    float samplingRate;
+    int waitInterval;           // usec, in case a wakeup is missed
+    DspLoadMeter *dspLoad;
+    bool realtime;
+    int priority;
+    RenderAheadWakeup *wakeup;
+    std::atomic<bool> keepRunning;
+    QSemaphore primed;          // released once, when the queue first fills
+};
+
+class RenderAheadThreadController : public QObject
+{
+    Q_OBJECT
+    QThread workerThread;
+    RenderAheadWorker *worker;
+    RenderAheadWakeup wakeup;
+
+public:
+    RenderAheadThreadController(PaUtilRingBuffer *queue, int aheadBlocks, int blockFrames, float samplingRate,
+                                DspLoadMeter *dspLoad, bool realtime, int priority) {
+        worker = new RenderAheadWorker(queue, aheadBlocks, blockFrames, samplingRate, dspLoad, realtime, priority, &wakeup);
+        worker->moveToThread(&workerThread);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &RenderAheadWorker::run);
+    }
+    ~RenderAheadThreadController() {
+        worker->stop();
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start() { workerThread.start(QThread::TimeCriticalPriority); }
+    void blockConsumed() { wakeup.signal(); }   // callback
+    bool waitPrimed(int msec) { return worker->waitPrimed(msec); }
+};
+
+#endif // RENDERAHEAD_H
@@ -0,0 +1,88 @@
+#include <QtGlobal>
+#include <QObject>
+#include <string.h>
+#include "rthardening.h"
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+int lockProcessMemory()
+{
+#ifdef Q_OS_UNIX
+    // MCL_FUTURE covers what RTcmix allocates when it loads instruments later.
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        return errno;
+    return 0;
+#else
+    return hardeningUnsupported;
+#endif
+}
+
+void unlockProcessMemory()
+{
+#ifdef Q_OS_UNIX
+    munlockall();
+#endif
+}
+
+int setCurrentThreadRealtime(int priority)
+{
+#ifdef Q_OS_UNIX
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = qBound(sched_get_priority_min(SCHED_FIFO), priority, sched_get_priority_max(SCHED_FIFO));
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);   // returns the errno value
+#else
+    Q_UNUSED(priority)
+    return hardeningUnsupported;
+#endif
+}
+
+int setCurrentThreadCPU(int cpu)
+{
+#ifdef Q_OS_LINUX
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return EINVAL;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    Q_UNUSED(cpu)
+    return hardeningUnsupported;
+#endif
+}
+
+bool setCurrentThreadFlushDenormals()
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    // FTZ (bit 15) flushes denormal results; DAZ (bit 6) treats denormal inputs as 0.
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+    return true;
+#elif defined(__aarch64__)
+    // FPCR.FZ (bit 24) does both.
+    unsigned long long fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+    __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr | (1ULL << 24)));
+    return true;
+#else
+    return false;
+#endif
+}
+
+QString hardeningResultString(int result)
+{
+    if (result == 0)
+        return QObject::tr("ok");
+    if (result == hardeningUnsupported)
+        return QObject::tr("not supported on this system");
+    return QString(QObject::tr("failed (%1)")).arg(QString::fromLocal8Bit(strerror(result)));
+}
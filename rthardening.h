@@ -0,0 +1,28 @@
+#ifndef RTHARDENING_H
+#define RTHARDENING_H
+
+#include <QString>
+
+// Optional steps that keep the audio callback from missing its deadline on a
+// loaded machine (see the Real-Time prefs): lock the process in memory so the
+// callback never waits on a page fault, and give the callback thread a fixed
+// real-time priority and CPU. Also, flush denormals to zero on that thread, so
+// that a reverb tail decaying toward silence doesn't slow the FPU to a crawl.
+
+// Results, for the log. 0 means the step worked, hardeningUnsupported that
+// this platform has no way to do it, and anything else is an errno value.
+const int hardeningUnsupported = -1;
+
+// Main thread. lockProcessMemory can take a while: it faults in every page.
+int lockProcessMemory();
+void unlockProcessMemory();
+
+// Audio callback thread, once per stream start, before RTcmix_runAudio.
+// Pass cpu < 0 to leave the thread free to run on any core.
+int setCurrentThreadRealtime(int priority);
+int setCurrentThreadCPU(int cpu);
+bool setCurrentThreadFlushDenormals();
+
+QString hardeningResultString(int result);
+
+#endif // RTHARDENING_H
@@ -0,0 +1,231 @@
+#include "sampleconvert.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAMPLECONVERT_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SAMPLECONVERT_NEON
+#endif
+
+void initDitherState(DitherState *state, uint32_t seed)
+{
+    // xorshift32 must never be seeded with zero
+    for (int i = 0; i < 4; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        state->lane[i] = seed ? seed : 0x9e3779b9u;
+    }
+}
+
+static inline uint32_t xorshift32(uint32_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// Uniform in [-0.5, 0.5): put 23 random bits into the mantissa of a float in [1, 2).
+static inline float uniformNoise(uint32_t &x)
+{
+    union { uint32_t i; float f; } u;
+    u.i = (xorshift32(x) >> 9) | 0x3f800000u;
+    return u.f - 1.5f;
+}
+
+// Scaling by a power of 2 is exact in float, and so is the sum of the two
+// noise values, but adding the noise to a sample isn't: at 24 bits a float
+// has only a bit or so below the LSB, which would round the dither to
+// half-LSB steps. So that sum, and what follows, is done in double.
+static void floatToIntDitheredScalar(const float *src, int32_t *dst, long count, int bits, uint32_t &rng)
+{
+    const float scale = float(1 << (bits - 1));
+    const double maxVal = double(scale) - 1.0;
+    const int shift = 32 - bits;
+    for (long i = 0; i < count; i++) {
+        const float noise = uniformNoise(rng) + uniformNoise(rng);
+        double samp = double(src[i] * scale) + double(noise);
+        if (samp > maxVal)
+            samp = maxVal;
+        else if (samp < -scale)
+            samp = -scale;
+        // round to nearest, as the SIMD conversions do
+        int32_t isamp = int32_t(samp >= 0.0 ? samp + 0.5 : samp - 0.5);
+        dst[i] = int32_t(uint32_t(isamp) << shift);
+    }
+}
+
+#if defined(SAMPLECONVERT_SSE2)
+
+static inline __m128i xorshift32x4(__m128i &x)
+{
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    return x;
+}
+
+static inline __m128 uniformNoisex4(__m128i &x)
+{
+    const __m128i one = _mm_set1_epi32(0x3f800000);
+    __m128i bits = _mm_or_si128(_mm_srli_epi32(xorshift32x4(x), 9), one);
+    return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.5f));
+}
+
+void floatToIntDithered(const float *src, int32_t *dst, long count, int bits, DitherState *state)
+{
+    const float scale = float(1 << (bits - 1));
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128d vmax = _mm_set1_pd(double(scale) - 1.0);
+    const __m128d vmin = _mm_set1_pd(-double(scale));
+    const __m128i vshift = _mm_cvtsi32_si128(32 - bits);
+    __m128i rng = _mm_loadu_si128((const __m128i *) state->lane);
+
+    long i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // The sample and noise are added in double; see floatToIntDitheredScalar.
+        const __m128 samp = _mm_mul_ps(_mm_loadu_ps(src + i), vscale);
+        const __m128 noise = _mm_add_ps(uniformNoisex4(rng), uniformNoisex4(rng));
+        __m128d lo = _mm_add_pd(_mm_cvtps_pd(samp), _mm_cvtps_pd(noise));
+        __m128d hi = _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(samp, samp)), _mm_cvtps_pd(_mm_movehl_ps(noise, noise)));
+        lo = _mm_max_pd(_mm_min_pd(lo, vmax), vmin);
+        hi = _mm_max_pd(_mm_min_pd(hi, vmax), vmin);
+        __m128i isamp = _mm_unpacklo_epi64(_mm_cvtpd_epi32(lo), _mm_cvtpd_epi32(hi));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_sll_epi32(isamp, vshift));
+    }
+    _mm_storeu_si128((__m128i *) state->lane, rng);
+    floatToIntDitheredScalar(src + i, dst + i, count - i, bits, state->lane[0]);
+}
+
+#elif defined(SAMPLECONVERT_NEON)
+
+static inline uint32x4_t xorshift32x4(uint32x4_t &x)
+{
+    x = veorq_u32(x, vshlq_n_u32(x, 13));
+    x = veorq_u32(x, vshrq_n_u32(x, 17));
+    x = veorq_u32(x, vshlq_n_u32(x, 5));
+    return x;
+}
+
+static inline float32x4_t uniformNoisex4(uint32x4_t &x)
+{
+    uint32x4_t bits = vorrq_u32(vshrq_n_u32(xorshift32x4(x), 9), vdupq_n_u32(0x3f800000));
+    return vsubq_f32(vreinterpretq_f32_u32(bits), vdupq_n_f32(1.5f));
+}
+
+void floatToIntDithered(const float *src, int32_t *dst, long count, int bits, DitherState *state)
+{
+    const float scale = float(1 << (bits - 1));
+    const float32x4_t vscale = vdupq_n_f32(scale);
+    const float64x2_t vmax = vdupq_n_f64(double(scale) - 1.0);
+    const float64x2_t vmin = vdupq_n_f64(-double(scale));
+    const int32x4_t vshift = vdupq_n_s32(32 - bits);
+    uint32x4_t rng = vld1q_u32(state->lane);
+
+    long i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // The sample and noise are added in double; see floatToIntDitheredScalar.
+        const float32x4_t samp = vmulq_f32(vld1q_f32(src + i), vscale);
+        const float32x4_t noise = vaddq_f32(uniformNoisex4(rng), uniformNoisex4(rng));
+        float64x2_t lo = vaddq_f64(vcvt_f64_f32(vget_low_f32(samp)), vcvt_f64_f32(vget_low_f32(noise)));
+        float64x2_t hi = vaddq_f64(vcvt_high_f64_f32(samp), vcvt_high_f64_f32(noise));
+        lo = vmaxq_f64(vminq_f64(lo, vmax), vmin);
+        hi = vmaxq_f64(vminq_f64(hi, vmax), vmin);
+        int32x4_t isamp = vcombine_s32(vmovn_s64(vcvtnq_s64_f64(lo)), vmovn_s64(vcvtnq_s64_f64(hi)));    // round to nearest
+        vst1q_s32(dst + i, vshlq_s32(isamp, vshift));
+    }
+    vst1q_u32(state->lane, rng);
+    floatToIntDitheredScalar(src + i, dst + i, count - i, bits, state->lane[0]);
+}
+
+#else
+
+void floatToIntDithered(const float *src, int32_t *dst, long count, int bits, DitherState *state)
+{
+    floatToIntDitheredScalar(src, dst, count, bits, state->lane[0]);
+}
+
+#endif
+
+
+static void deinterleaveScalar(const float *src, float *const *dst, long startFrame, long numFrames, int numChans)
+{
+    for (long f = startFrame; f < numFrames; f++) {
+        const float *frame = src + f * numChans;
+        for (int c = 0; c < numChans; c++)
+            dst[c][f] = frame[c];
+    }
+}
+
+#if defined(SAMPLECONVERT_SSE2)
+
+void deinterleave(const float *src, float *const *dst, long numFrames, int numChans)
+{
+    long f = 0;
+    if (numChans == 2) {
+        float *left = dst[0];
+        float *right = dst[1];
+        for (; f + 4 <= numFrames; f += 4) {
+            const __m128 a = _mm_loadu_ps(src + f * 2);         // L0 R0 L1 R1
+            const __m128 b = _mm_loadu_ps(src + f * 2 + 4);     // L2 R2 L3 R3
+            _mm_storeu_ps(left + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(right + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    }
+    else if ((numChans & 3) == 0) {
+        // Transpose 4 frames x 4 channels at a time.
+        for (; f + 4 <= numFrames; f += 4) {
+            const float *frame = src + f * numChans;
+            for (int c = 0; c < numChans; c += 4) {
+                __m128 r0 = _mm_loadu_ps(frame + c);
+                __m128 r1 = _mm_loadu_ps(frame + numChans + c);
+                __m128 r2 = _mm_loadu_ps(frame + 2 * numChans + c);
+                __m128 r3 = _mm_loadu_ps(frame + 3 * numChans + c);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                _mm_storeu_ps(dst[c] + f, r0);
+                _mm_storeu_ps(dst[c + 1] + f, r1);
+                _mm_storeu_ps(dst[c + 2] + f, r2);
+                _mm_storeu_ps(dst[c + 3] + f, r3);
+            }
+        }
+    }
+    deinterleaveScalar(src, dst, f, numFrames, numChans);
+}
+
+#elif defined(SAMPLECONVERT_NEON)
+
+void deinterleave(const float *src, float *const *dst, long numFrames, int numChans)
+{
+    long f = 0;
+    if (numChans == 2) {
+        for (; f + 4 <= numFrames; f += 4) {
+            const float32x4x2_t lr = vld2q_f32(src + f * 2);
+            vst1q_f32(dst[0] + f, lr.val[0]);
+            vst1q_f32(dst[1] + f, lr.val[1]);
+        }
+    }
+    else if ((numChans & 3) == 0) {
+        // Transpose 4 frames x 4 channels at a time.
+        for (; f + 4 <= numFrames; f += 4) {
+            const float *frame = src + f * numChans;
+            for (int c = 0; c < numChans; c += 4) {
+                const float32x4x2_t t0 = vtrnq_f32(vld1q_f32(frame + c), vld1q_f32(frame + numChans + c));
+                const float32x4x2_t t1 = vtrnq_f32(vld1q_f32(frame + 2 * numChans + c), vld1q_f32(frame + 3 * numChans + c));
+                vst1q_f32(dst[c] + f, vcombine_f32(vget_low_f32(t0.val[0]), vget_low_f32(t1.val[0])));
+                vst1q_f32(dst[c + 1] + f, vcombine_f32(vget_low_f32(t0.val[1]), vget_low_f32(t1.val[1])));
+                vst1q_f32(dst[c + 2] + f, vcombine_f32(vget_high_f32(t0.val[0]), vget_high_f32(t1.val[0])));
+                vst1q_f32(dst[c + 3] + f, vcombine_f32(vget_high_f32(t0.val[1]), vget_high_f32(t1.val[1])));
+            }
+        }
+    }
+    deinterleaveScalar(src, dst, f, numFrames, numChans);
+}
+
+#else
+
+void deinterleave(const float *src, float *const *dst, long numFrames, int numChans)
+{
+    deinterleaveScalar(src, dst, 0, numFrames, numChans);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SAMPLECONVERT_H
+#define SAMPLECONVERT_H
+
+#include <stdint.h>
+
+// Sample conversion kernels for the record thread. These use SSE2 on x86 and
+// NEON on 64-bit ARM (both baseline for the targets we build), with a scalar
+// version for everything else and for the odd samples at the end of a buffer.
+
+// State for the dither noise generator: one xorshift32 per SIMD lane.
+struct DitherState {
+    uint32_t lane[4];
+};
+
+void initDitherState(DitherState *, uint32_t seed);
+
+// Convert normalized float samples to <bits>-bit integers (16 or 24), adding
+// triangular (TPDF) dither of +/- 1 LSB, and clipping to the integer range.
+// Results are left-justified in 32-bit ints, which is what sf_write_int()
+// expects no matter what bit depth the file has.
+void floatToIntDithered(const float *src, int32_t *dst, long count, int bits, DitherState *);
+
+// Split <numFrames> frames of interleaved <numChans>-channel audio into one
+// buffer per channel. Stereo, and channel counts that are a multiple of 4,
+// get SIMD versions; anything else goes a sample at a time.
+void deinterleave(const float *src, float *const *dst, long numFrames, int numChans);
+
+#endif // SAMPLECONVERT_H
@@ -0,0 +1,171 @@
+#include <math.h>
+#include <qmath.h>     // M_PI everywhere
+#include <string.h>
+#include "sampleconvert.h"
+#include "truepeak.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TRUEPEAK_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define TRUEPEAK_NEON
+#endif
+
+// Frames per pass through the filters.
+const long blockFrames = 1024;
+const int historySamps = TruePeakDetector::tapsPerPhase - 1;
+
+TruePeakDetector::TruePeakDetector(int numChans)
+    : numChans(numChans)
+    , peaks(numChans, 0.0f)
+{
+    // Design the 48-tap interpolation filter: a Blackman-windowed sinc with
+    // its cutoff at the original Nyquist frequency. Phase p of the output
+    // at input sample m is sum(k) x[m - k] * h[phases * k + p].
+    const int numTaps = phases * tapsPerPhase;
+    double h[phases * tapsPerPhase];
+    for (int n = 0; n < numTaps; n++) {
+        const double t = (n - (numTaps - 1) / 2.0) / phases;
+        const double sinc = (t == 0.0) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+        const double w = 0.42 - 0.5 * cos(2.0 * M_PI * n / (numTaps - 1)) + 0.08 * cos(4.0 * M_PI * n / (numTaps - 1));
+        h[n] = sinc * w;
+    }
+    for (int p = 0; p < phases; p++) {
+        // Unity gain at DC for each phase, so a constant input reads the same upsampled.
+        double sum = 0.0;
+        for (int k = 0; k < tapsPerPhase; k++)
+            sum += h[phases * k + p];
+        for (int k = 0; k < tapsPerPhase; k++)
+            coefs[k * phases + p] = float(h[phases * k + p] / sum);
+    }
+
+    const long channelSamps = historySamps + blockFrames;
+    workBuffer = new float [numChans * channelSamps]();
+    channelInput.resize(numChans);
+    for (int c = 0; c < numChans; c++)
+        channelInput[c] = workBuffer + c * channelSamps + historySamps;
+}
+
+TruePeakDetector::~TruePeakDetector()
+{
+    delete [] workBuffer;
+}
+
+void TruePeakDetector::resetPeaks()
+{
+    peaks.fill(0.0f);
+}
+
+void TruePeakDetector::process(const float *samps, long numFrames)
+{
+    while (numFrames > 0) {
+        const long frames = qMin(numFrames, blockFrames);
+        deinterleave(samps, channelInput.constData(), frames, numChans);
+        for (int c = 0; c < numChans; c++)
+            processChannel(c, frames);
+        samps += frames * numChans;
+        numFrames -= frames;
+    }
+}
+
+// Run the 4 phases of the filter in parallel: for each input sample, one
+// 4-wide multiply-add per tap gives all 4 upsampled outputs.
+void TruePeakDetector::processChannel(int chan, long numFrames)
+{
+    const float *x = channelInput[chan];      // x[-historySamps .. numFrames - 1] are valid
+#if defined(TRUEPEAK_SSE2)
+    __m128 c[tapsPerPhase];
+    for (int k = 0; k < tapsPerPhase; k++)
+        c[k] = _mm_loadu_ps(coefs + k * phases);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 vmax = _mm_setzero_ps();
+    for (long i = 0; i < numFrames; i++) {
+        __m128 acc = _mm_mul_ps(c[0], _mm_set1_ps(x[i]));
+        for (int k = 1; k < tapsPerPhase; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(c[k], _mm_set1_ps(x[i - k])));
+        vmax = _mm_max_ps(vmax, _mm_andnot_ps(signMask, acc));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    const float blockPeak = qMax(qMax(lanes[0], lanes[1]), qMax(lanes[2], lanes[3]));
+#elif defined(TRUEPEAK_NEON)
+    float32x4_t c[tapsPerPhase];
+    for (int k = 0; k < tapsPerPhase; k++)
+        c[k] = vld1q_f32(coefs + k * phases);
+    float32x4_t vmax = vdupq_n_f32(0.0f);
+    for (long i = 0; i < numFrames; i++) {
+        float32x4_t acc = vmulq_n_f32(c[0], x[i]);
+        for (int k = 1; k < tapsPerPhase; k++)
+            acc = vmlaq_n_f32(acc, c[k], x[i - k]);
+        vmax = vmaxq_f32(vmax, vabsq_f32(acc));
+    }
+    const float blockPeak = vmaxvq_f32(vmax);
+#else
+    float blockPeak = 0.0f;
+    for (long i = 0; i < numFrames; i++) {
+        for (int p = 0; p < phases; p++) {
+            float acc = 0.0f;
+            for (int k = 0; k < tapsPerPhase; k++)
+                acc += coefs[k * phases + p] * x[i - k];
+            blockPeak = qMax(blockPeak, fabsf(acc));
+        }
+    }
+#endif
+    if (blockPeak > peaks[chan])
+        peaks[chan] = blockPeak;
+
+    // Keep the last few samples as history for the next block.
+    float *base = channelInput[chan] - historySamps;
+    memmove(base, base + numFrames, historySamps * sizeof(float));
+}
+
+
+TruePeakWorker::TruePeakWorker(int numChans, PaUtilRingBuffer *ringBuffer, std::atomic<float> *peaks, int drainInterval)
+    : detector(numChans)
+    , numChans(numChans)
+    , ringBuffer(ringBuffer)
+    , peaks(peaks)
+    , drainInterval(drainInterval)
+    , keepRunning(true)
+{
+}
+
+// Called from the main thread.
+void TruePeakWorker::stop()
+{
+    keepRunning = false;
+    wakeup.release();
+}
+
+void TruePeakWorker::run()
+{
+    while (keepRunning) {
+        wakeup.tryAcquire(1, drainInterval);
+        drain();
+    }
+}
+
+// Measure everything in the ring, then raise the shared peaks, which the
+// GUI thread takes (and zeroes) at its own pace.
+void TruePeakWorker::drain()
+{
+    ring_buffer_size_t framesAvail = PaUtil_GetRingBufferReadAvailable(ringBuffer);
+    if (framesAvail == 0)
+        return;
+    void *region1, *region2;
+    ring_buffer_size_t size1, size2;
+    ring_buffer_size_t framesRead = PaUtil_GetRingBufferReadRegions(ringBuffer, framesAvail, &region1, &size1, &region2, &size2);
+    detector.resetPeaks();
+    detector.process((const float *) region1, size1);
+    if (size2 > 0)
+        detector.process((const float *) region2, size2);
+    PaUtil_AdvanceRingBufferReadIndex(ringBuffer, framesRead);
+
+    for (int c = 0; c < numChans; c++) {
+        const float peak = detector.peak(c);
+        float old = peaks[c].load(std::memory_order_relaxed);
+        while (peak > old && !peaks[c].compare_exchange_weak(old, peak, std::memory_order_relaxed))
+            ;
+    }
+}
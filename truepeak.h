@@ -0,0 +1,90 @@
+#ifndef TRUEPEAK_H
+#define TRUEPEAK_H
+
+#include <atomic>
+#include <QObject>
+#include <QSemaphore>
+#include <QThread>
+#include <QVector>
+#include "pa_ringbuffer.h"
+#include "utils.h"
+
+// True-peak (inter-sample peak) measurement, as in ITU-R BS.1770: upsample
+// each channel 4x with a polyphase FIR and take the largest magnitude. This
+// catches overs that the sample-peak test misses: a signal whose samples all
+// stay below full scale can still clip in a D/A converter's reconstruction
+// filter or in a lossy encoder.
+//
+// All of this runs on its own thread. The audio callback only copies each
+// output buffer into a ring (of whole frames), and skips the copy if the
+// ring is full.
+
+class TruePeakDetector
+{
+public:
+    explicit TruePeakDetector(int numChans);
+    ~TruePeakDetector();
+
+    // Interleaved input. Raises peak(c) to the largest upsampled magnitude seen.
+    void process(const float *samps, long numFrames);
+    float peak(int chan) const { return peaks[chan]; }
+    void resetPeaks();
+
+    static const int phases = 4;
+    static const int tapsPerPhase = 12;
+
+private:
+    void processChannel(int chan, long numFrames);
+
+    int numChans;
+    float coefs[phases * tapsPerPhase];     // [tap][phase]
+    float *workBuffer;          // per channel: tapsPerPhase - 1 history samps, then a block
+    QVector<float *> channelInput;
+    QVector<float> peaks;
+};
+
+class TruePeakWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    TruePeakWorker(int numChans, PaUtilRingBuffer *, std::atomic<float> *peaks, int drainInterval);
+    void stop();
+
+public slots:
+    void run();
+
+private:
+    void drain();
+
+    TruePeakDetector detector;
+    int numChans;
+    PaUtilRingBuffer *ringBuffer;
+    std::atomic<float> *peaks;
+    int drainInterval;
+    std::atomic<bool> keepRunning;
+    QSemaphore wakeup;
+};
+
+class TruePeakThreadController : public QObject
+{
+    Q_OBJECT
+    QThread workerThread;
+    TruePeakWorker *worker;
+
+public:
+    TruePeakThreadController(int numChans, PaUtilRingBuffer *ringBuf, std::atomic<float> *peaks, int drainInterval) {
+        worker = new TruePeakWorker(numChans, ringBuf, peaks, drainInterval);
+        worker->moveToThread(&workerThread);
+        CHECKED_CONNECT(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+        CHECKED_CONNECT(&workerThread, &QThread::started, worker, &TruePeakWorker::run);
+    }
+    ~TruePeakThreadController() {
+        worker->stop();
+        workerThread.quit();
+        workerThread.wait();
+    }
+    void start() { workerThread.start(QThread::LowPriority); }
+};
+
+#endif // TRUEPEAK_H